@@ -5,9 +5,15 @@
 #include "libs/minizip/zip.h"
 #include "LossyCompressor.h"
 #include <ctime>
+#include <cctype>
 #include <filesystem>
+#include <fstream>
 #include <string>
 #include <utility>
+#include <limits>
+#include <future>
+#include <map>
+#include <algorithm>
 #include <cassert>
 
 #if defined(_WIN32)
@@ -86,6 +92,279 @@ namespace {
     return std::mktime(&time);
   }
 
+  time_t to_time_t(tm_zip tmz_date) {
+    return to_time_t(tm_unz{
+      tmz_date.tm_sec, tmz_date.tm_min, tmz_date.tm_hour,
+      tmz_date.tm_mday, tmz_date.tm_mon, tmz_date.tm_year
+    });
+  }
+
+  uint16_t read_uint16(const std::byte* data) {
+    const auto bytes = reinterpret_cast<const uint8_t*>(data);
+    return static_cast<uint16_t>(bytes[0] | bytes[1] << 8);
+  }
+
+  uint32_t read_uint32(const std::byte* data) {
+    return static_cast<uint32_t>(read_uint16(data) |
+      static_cast<uint32_t>(read_uint16(data + 2)) << 16);
+  }
+
+  uint64_t read_uint64(const std::byte* data) {
+    return static_cast<uint64_t>(read_uint32(data) |
+      static_cast<uint64_t>(read_uint32(data + 4)) << 32);
+  }
+
+  struct CentralHeader {
+    std::string_view filename;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
+    uint32_t dos_date;
+    int compression_method;
+    uint32_t crc32;
+    bool encrypted;
+    uint64_t size;
+  };
+
+  std::optional<CentralHeader> read_central_header(ByteView file, uint64_t offset) {
+    const auto signature = 0x02014b50u;
+    const auto header_size = 46u;
+    const auto file_size = static_cast<uint64_t>(file.size());
+
+    if (offset + header_size > file_size)
+      return std::nullopt;
+    const auto central = file.data() + offset;
+    if (read_uint32(central) != signature)
+      return std::nullopt;
+
+    const auto filename_size = read_uint16(central + 28);
+    const auto extra_size = read_uint16(central + 30);
+    const auto comment_size = read_uint16(central + 32);
+    auto header = CentralHeader{ };
+    header.size = uint64_t{ header_size } + filename_size + extra_size + comment_size;
+    if (offset + header.size > file_size)
+      return std::nullopt;
+
+    header.filename = std::string_view(
+      reinterpret_cast<const char*>(central + header_size), filename_size);
+    header.compressed_size = read_uint32(central + 20);
+    header.uncompressed_size = read_uint32(central + 24);
+    header.local_header_offset = read_uint32(central + 42);
+    header.dos_date = read_uint32(central + 12);
+    header.compression_method = read_uint16(central + 10);
+    header.crc32 = read_uint32(central + 16);
+    header.encrypted = ((read_uint16(central + 8) & 0x01) != 0);
+
+    // read from zip64 extended information extra field
+    auto extra = central + header_size + filename_size;
+    const auto extra_end = extra + extra_size;
+    while (extra + 4 <= extra_end) {
+      const auto id = read_uint16(extra);
+      const auto size = read_uint16(extra + 2);
+      extra += 4;
+      if (id == 0x0001) {
+        auto field = extra;
+        const auto field_end = std::min(extra + size, extra_end);
+        for (auto value : { &header.uncompressed_size,
+                            &header.compressed_size,
+                            &header.local_header_offset })
+          if (*value == 0xFFFFFFFF && field + 8 <= field_end) {
+            *value = read_uint64(field);
+            field += 8;
+          }
+        break;
+      }
+      extra += size;
+    }
+    return header;
+  }
+
+  // returns position of file data, 0 when it could not be determined
+  uint64_t get_data_offset(ByteView file, const CentralHeader& header) {
+    const auto signature = 0x04034b50u;
+    const auto header_size = 30u;
+    const auto file_size = static_cast<uint64_t>(file.size());
+
+    if (header.encrypted || (header.compression_method != 0 &&
+                             header.compression_method != Z_DEFLATED))
+      return 0;
+
+    const auto offset = header.local_header_offset;
+    if (offset + header_size > file_size)
+      return 0;
+    const auto local = file.data() + offset;
+    if (read_uint32(local) != signature)
+      return 0;
+    const auto data_offset = offset + header_size +
+      read_uint16(local + 26) + read_uint16(local + 28);
+    if (data_offset + header.compressed_size > file_size)
+      return 0;
+    return data_offset;
+  }
+
+  time_t dos_date_to_time_t(uint32_t dos_date) {
+    auto time = std::tm{ };
+    time.tm_sec = static_cast<int>(2 * (dos_date & 0x1F));
+    time.tm_min = static_cast<int>((dos_date >> 5) & 0x3F);
+    time.tm_hour = static_cast<int>((dos_date >> 11) & 0x1F);
+    time.tm_mday = static_cast<int>((dos_date >> 16) & 0x1F);
+    time.tm_mon = static_cast<int>((dos_date >> 21) & 0x0F) - 1;
+    time.tm_year = static_cast<int>((dos_date >> 25) & 0x7F) + 80;
+    time.tm_isdst = -1;
+    return std::mktime(&time);
+  }
+
+  struct CentralDirectory {
+    uint64_t offset;
+    uint64_t entry_count;
+    std::string_view comment;
+  };
+
+  std::optional<CentralDirectory> find_central_directory(ByteView file) {
+    const auto end_signature = 0x06054b50u;
+    const auto end_size = 22u;
+    const auto zip64_locator_signature = 0x07064b50u;
+    const auto zip64_locator_size = 20u;
+    const auto zip64_end_signature = 0x06064b50u;
+    const auto zip64_end_size = 56u;
+    const auto file_size = static_cast<uint64_t>(file.size());
+    if (file_size < end_size)
+      return std::nullopt;
+
+    // search end of central directory record, which can be followed by a comment
+    const auto min_offset = file_size - std::min(file_size, uint64_t{ end_size + 0xFFFF });
+    for (auto offset = file_size - end_size; ; --offset) {
+      const auto end = file.data() + offset;
+      if (read_uint32(end) == end_signature) {
+        const auto comment_size = std::min(uint64_t{ read_uint16(end + 20) },
+          file_size - offset - end_size);
+        auto directory = CentralDirectory{ read_uint32(end + 16), read_uint16(end + 10),
+          std::string_view(reinterpret_cast<const char*>(end + end_size),
+            static_cast<size_t>(comment_size)) };
+        if (offset >= zip64_locator_size) {
+          const auto locator = end - zip64_locator_size;
+          if (read_uint32(locator) == zip64_locator_signature) {
+            const auto zip64_offset = read_uint64(locator + 8);
+            if (zip64_offset + zip64_end_size > file_size)
+              return std::nullopt;
+            const auto zip64_end = file.data() + zip64_offset;
+            if (read_uint32(zip64_end) != zip64_end_signature)
+              return std::nullopt;
+            directory.entry_count = read_uint64(zip64_end + 32);
+            directory.offset = read_uint64(zip64_end + 48);
+          }
+        }
+        return directory;
+      }
+      if (offset == min_offset)
+        return std::nullopt;
+    }
+  }
+
+  // index of all entries, written when archive is closed, all integers are little endian:
+  //   magic "WRIX", version, entry count, archive entry count (uint32)
+  //   entries in archive order, aliases share the data of another entry:
+  //     filename offset, filename size (uint32),
+  //     data offset, compressed size, uncompressed size, modification time (uint64),
+  //     compression method, CRC-32 (uint32)
+  //   filenames
+  // its position is stored in the archive comment as "WRIX <data offset> <size>"
+  const auto index_filename = std::string("index");
+  const auto index_magic = std::string_view("WRIX");
+  const auto index_version = uint32_t{ 3 };
+  const auto index_header_size = size_t{ 16 };
+  const auto index_entry_size = size_t{ 48 };
+  const auto aliases_filename = std::string("aliases");
+
+  void write_uint16(std::string& data, size_t offset, uint64_t value) {
+    for (auto i = size_t{ }; i < 2; ++i)
+      data[offset + i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+  }
+
+  void write_uint32(std::string& data, size_t offset, uint64_t value) {
+    for (auto i = size_t{ }; i < 4; ++i)
+      data[offset + i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+  }
+
+  void write_uint64(std::string& data, size_t offset, uint64_t value) {
+    write_uint32(data, offset, value & 0xFFFFFFFF);
+    write_uint32(data, offset + 4, value >> 32);
+  }
+
+  std::optional<std::pair<uint64_t, uint64_t>> parse_index_comment(
+      std::string_view comment) {
+    if (comment.substr(0, index_magic.size()) != index_magic)
+      return std::nullopt;
+    comment.remove_prefix(index_magic.size());
+    auto values = std::pair<uint64_t, uint64_t>{ };
+    for (auto value : { &values.first, &values.second }) {
+      if (comment.empty() || comment.front() != ' ')
+        return std::nullopt;
+      comment.remove_prefix(1);
+      if (comment.empty() || !std::isdigit(static_cast<unsigned char>(comment.front())))
+        return std::nullopt;
+      while (!comment.empty() && std::isdigit(static_cast<unsigned char>(comment.front()))) {
+        *value = *value * 10 + static_cast<uint64_t>(comment.front() - '0');
+        comment.remove_prefix(1);
+      }
+    }
+    if (!comment.empty())
+      return std::nullopt;
+    return values;
+  }
+
+  bool inflate_raw(ByteView data, ByteVector& buffer) {
+    auto stream = z_stream{ };
+    if (::inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+      return false;
+    auto guard = std::shared_ptr<void>(nullptr, [&](auto) { ::inflateEnd(&stream); });
+
+    const auto max_chunk_size = size_t{ std::numeric_limits<uInt>::max() };
+    auto input = data.data();
+    auto input_end = data.data() + data.size();
+    auto output = buffer.data();
+    auto output_end = buffer.data() + buffer.size();
+    for (;;) {
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(input));
+      stream.avail_in = static_cast<uInt>(std::min(max_chunk_size,
+        static_cast<size_t>(input_end - input)));
+      stream.next_out = reinterpret_cast<Bytef*>(output);
+      stream.avail_out = static_cast<uInt>(std::min(max_chunk_size,
+        static_cast<size_t>(output_end - output)));
+      const auto result = ::inflate(&stream, Z_NO_FLUSH);
+      input = reinterpret_cast<const std::byte*>(stream.next_in);
+      output = reinterpret_cast<std::byte*>(stream.next_out);
+      if (result == Z_STREAM_END)
+        return (output == output_end);
+      if (result != Z_OK)
+        return false;
+    }
+  }
+
+  bool deflate_raw(ByteView data, ByteVector& buffer, int level) {
+    auto stream = z_stream{ };
+    if (::deflateInit2(&stream, level, Z_DEFLATED,
+          -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    auto guard = std::shared_ptr<void>(nullptr, [&](auto) { ::deflateEnd(&stream); });
+
+    buffer.resize(::deflateBound(&stream, static_cast<uLong>(data.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+    stream.avail_out = static_cast<uInt>(buffer.size());
+    if (::deflate(&stream, Z_FINISH) != Z_STREAM_END)
+      return false;
+    buffer.resize(stream.total_out);
+    return true;
+  }
+
+  uint32_t get_crc32(ByteView data) {
+    return static_cast<uint32_t>(::crc32(::crc32(0, nullptr, 0),
+      reinterpret_cast<const Bytef*>(data.data()),
+      static_cast<uInt>(data.size())));
+  }
+
   bool is_root_filename(std::string_view filename) {
     return (std::count_if(filename.cbegin(), filename.cend(),
         [](char c) { return c == '/'; }) == 0);
@@ -102,29 +381,55 @@ void ArchiveReader::set_overlay_path(std::string path) {
   m_overlay_path = std::move(path);
 }
 
+void ArchiveReader::set_context_count(size_t count) {
+  m_context_count = count;
+}
+
 bool ArchiveReader::open(const std::filesystem::path& filename) {
   close();
 
   m_filename = filename;
-  return read_contents(false);
+  m_mapped_file.open(m_filename);
+  if (!read_contents(false))
+    return false;
+  warm_contexts();
+  return true;
 }
 
 bool ArchiveReader::open_root(const std::filesystem::path& filename) {
   close();
 
   m_filename = filename;
-  return read_contents(true);
+  m_mapped_file.open(m_filename);
+  if (!read_contents(true))
+    return false;
+  warm_contexts();
+  return true;
 }
 
-void* ArchiveReader::acquire_context() const {
-  auto lock = std::lock_guard(m_mutex);
+void ArchiveReader::warm_contexts() {
+  // contexts are only needed for files which cannot be read from mapped file
+  auto all_mapped = true;
+  m_contents.for_each([&](std::string_view, const FileInfo& info) {
+    all_mapped &= (info.data_offset != 0);
+  });
+  if (all_mapped)
+    return;
 
-  if (!m_unzip_contexts.empty()) {
-    auto unzip = m_unzip_contexts.back();
-    m_unzip_contexts.pop_back();
-    return unzip;
-  }
+  const auto count = std::min(m_unzip_contexts.size(), m_context_count);
+  for (auto i = size_t{ }; i < count; ++i)
+    if (!m_unzip_contexts[i].load())
+      m_unzip_contexts[i].store(open_context());
+}
 
+void* ArchiveReader::acquire_context() const {
+  for (auto& slot : m_unzip_contexts)
+    if (auto unzip = slot.exchange(nullptr))
+      return unzip;
+  return open_context();
+}
+
+void* ArchiveReader::open_context() const {
 #if defined(_WIN32)
   auto filefunc = zlib_filefunc64_def{ };
   ::fill_win32_filefunc64W(&filefunc);
@@ -135,15 +440,20 @@ void* ArchiveReader::acquire_context() const {
 }
 
 void ArchiveReader::return_context(void* context) const {
-  auto lock = std::lock_guard(m_mutex);
-  m_unzip_contexts.push_back(context);
+  for (auto& slot : m_unzip_contexts) {
+    auto empty = std::add_pointer_t<void>{ };
+    if (slot.compare_exchange_strong(empty, context))
+      return;
+  }
+  ::unzClose(context);
 }
 
 void ArchiveReader::close() {
-  auto lock = std::lock_guard(m_mutex);
-  for (auto* unzip : m_unzip_contexts)
-    ::unzClose(unzip);
-  m_unzip_contexts.clear();
+  for (auto& slot : m_unzip_contexts)
+    if (auto unzip = slot.exchange(nullptr))
+      ::unzClose(unzip);
+  m_mapped_file.close();
+  m_contents.clear();
 }
 
 auto ArchiveReader::get_file_info(const std::string& filename, 
@@ -152,44 +462,84 @@ auto ArchiveReader::get_file_info(const std::string& filename,
 
   if (version == top || version == overlay)
     if (!m_overlay_path.empty())
-      if (auto info = do_get_file_info(m_overlay_path + filename))
-        return info;
+      if (auto info = m_contents.find(m_overlay_path, filename))
+        return *info;
 
   if (version == top || version == base)
-    return do_get_file_info(filename);
-
-  return { };
-}
+    if (auto info = m_contents.find(filename))
+      return *info;
 
-auto ArchiveReader::do_get_file_info(const std::string& filename) const -> std::optional<FileInfo> {
-  if (auto it = m_contents.find(filename); it != m_contents.end())
-    return it->second;
   return { };
 }
 
 ByteVector ArchiveReader::read(const std::string& filename,
     FileVersion version) const {
+  auto buffer = ByteVector();
+  const auto data = read(filename, buffer, version);
+  if (data.data() != buffer.data())
+    return { data.begin(), data.end() };
+  return buffer;
+}
+
+ByteView ArchiveReader::read(const std::string& filename,
+    ByteVector& buffer, FileVersion version) const {
   assert(is_valid_filename(filename));
 
   if (version == top || version == overlay)
     if (!m_overlay_path.empty())
-      if (auto data = do_read(m_overlay_path + filename); !data.empty())
+      if (auto data = do_read(m_contents.find(m_overlay_path, filename), buffer);
+          !data.empty())
         return data;
 
   if (version == top || version == base)
-    return do_read(filename);
+    return do_read(m_contents.find(filename), buffer);
 
   return { };
 }
 
-ByteVector ArchiveReader::do_read(const std::string& filename) const {
-  const auto it = m_contents.find(filename);
-  if (it == m_contents.end())
+ByteView ArchiveReader::read_raw(const std::string& filename,
+    FileVersion version) const {
+  const auto info = get_file_info(filename, version);
+  if (!info || !info->data_offset)
+    return { };
+  return m_mapped_file.data().subspan(
+    static_cast<ByteView::size_type>(info->data_offset),
+    static_cast<ByteView::size_type>(info->compressed_size));
+}
+
+ByteView ArchiveReader::do_read(const FileInfo* info, ByteVector& buffer) const {
+  if (!info)
     return { };
 
+  if (info->data_offset)
+    return do_read_mapped(*info, buffer);
+
+  return do_read_unzip(*info, buffer);
+}
+
+ByteView ArchiveReader::do_read_mapped(const FileInfo& info,
+    ByteVector& buffer) const {
+  const auto data = m_mapped_file.data().subspan(
+    static_cast<ByteView::size_type>(info.data_offset),
+    static_cast<ByteView::size_type>(info.compressed_size));
+
+  if (info.compression_method == 0)
+    return data;
+
+  if (info.compression_method == Z_DEFLATED) {
+    buffer.resize(info.uncompressed_size);
+    if (inflate_raw(data, buffer))
+      return buffer;
+  }
+  buffer.clear();
+  return { };
+}
+
+ByteView ArchiveReader::do_read_unzip(const FileInfo& info,
+    ByteVector& buffer) const {
   auto position = unz64_file_pos{
-    it->second.directory_entry,
-    it->second.file_index
+    info.directory_entry,
+    info.file_index
   };
 
   auto unzip = acquire_context();
@@ -201,18 +551,27 @@ ByteVector ArchiveReader::do_read(const std::string& filename) const {
       ::unzOpenCurrentFile(unzip) != UNZ_OK)
     return { };
 
-  auto info = unz_file_info{ };
-  ::unzGetCurrentFileInfo(unzip, &info,
-    nullptr, 0, nullptr, 0, nullptr, 0);
-  auto buffer = ByteVector(info.uncompressed_size);
+  buffer.resize(info.uncompressed_size);
   ::unzReadCurrentFile(unzip, buffer.data(),
     static_cast<unsigned int>(info.uncompressed_size));
   ::unzCloseCurrentFile(unzip);
-
   return buffer;
 }
 
 bool ArchiveReader::read_contents(bool only_root) {
+  if (m_mapped_file.is_open() && read_index(only_root))
+    return true;
+
+  if (!(m_mapped_file.is_open() && read_central_directory(only_root)) &&
+      !read_contents_unzip(only_root))
+    return false;
+
+  if (!only_root)
+    read_aliases();
+  return true;
+}
+
+bool ArchiveReader::read_contents_unzip(bool only_root) {
   auto unzip = acquire_context();
   if (!unzip)
     return false;
@@ -230,12 +589,21 @@ bool ArchiveReader::read_contents(bool only_root) {
       auto position = unz64_file_pos{ };
       ::unzGetFilePos64(unzip, &position);
 
-      m_contents.emplace(filename, FileInfo{
+      auto data_offset = uint64_t{ };
+      if (m_mapped_file.is_open())
+        if (auto header = read_central_header(m_mapped_file.data(),
+              position.pos_in_zip_directory))
+          data_offset = get_data_offset(m_mapped_file.data(), header.value());
+
+      m_contents.insert_or_assign(filename, FileInfo{
         static_cast<size_t>(info.compressed_size),
         static_cast<size_t>(info.uncompressed_size),
         to_time_t(info.tmu_date),
         position.pos_in_zip_directory,
-        position.num_of_file
+        position.num_of_file,
+        data_offset,
+        static_cast<int>(info.compression_method),
+        static_cast<uint32_t>(info.crc),
       });
     }
 
@@ -244,13 +612,150 @@ bool ArchiveReader::read_contents(bool only_root) {
   return true;
 }
 
+bool ArchiveReader::read_central_directory(bool only_root) {
+  // read whole central directory from mapped file at once
+  const auto file = m_mapped_file.data();
+  const auto directory = find_central_directory(file);
+  if (!directory)
+    return false;
+
+  auto contents = FileIndex<FileInfo>();
+  contents.reserve(static_cast<size_t>(std::min(directory->entry_count,
+    uint64_t{ file.size() / 46 })));
+  auto offset = directory->offset;
+  for (auto i = uint64_t{ }; i < directory->entry_count; ++i) {
+    const auto header = read_central_header(file, offset);
+    if (!header)
+      return false;
+
+    // entries can be replaced by appending an entry with the same name
+    if (!only_root || is_root_filename(header->filename))
+      contents.insert_or_assign(header->filename, FileInfo{
+        header->compressed_size,
+        header->uncompressed_size,
+        dos_date_to_time_t(header->dos_date),
+        offset,
+        i,
+        get_data_offset(file, header.value()),
+        header->compression_method,
+        header->crc32,
+      });
+    offset += header->size;
+  }
+  m_contents = std::move(contents);
+  return true;
+}
+
+bool ArchiveReader::read_index(bool only_root) {
+  // load index written by ArchiveWriter, so central directory is not scanned
+  const auto file = m_mapped_file.data();
+  const auto directory = find_central_directory(file);
+  if (!directory)
+    return false;
+  const auto position = parse_index_comment(directory->comment);
+  if (!position)
+    return false;
+  const auto [index_offset, index_size] = position.value();
+  if (index_size < index_header_size ||
+      index_offset + index_size > directory->offset)
+    return false;
+
+  const auto index = as_string_view(file.subspan(
+    static_cast<ByteView::size_type>(index_offset),
+    static_cast<ByteView::size_type>(index_size)));
+  if (index.substr(0, index_magic.size()) != index_magic ||
+      read_uint32(file.data() + index_offset + 4) != index_version)
+    return false;
+
+  // index was written as last entry
+  const auto count = uint64_t{ read_uint32(file.data() + index_offset + 8) };
+  const auto archive_count = uint64_t{ read_uint32(file.data() + index_offset + 12) };
+  if (archive_count + 1 != directory->entry_count ||
+      index_header_size + count * index_entry_size > index_size)
+    return false;
+
+  auto contents = FileIndex<FileInfo>();
+  contents.reserve(static_cast<size_t>(count));
+  for (auto i = uint64_t{ }; i < count; ++i) {
+    const auto entry = file.data() + index_offset +
+      index_header_size + i * index_entry_size;
+    const auto filename_offset = uint64_t{ read_uint32(entry) };
+    const auto filename_size = uint64_t{ read_uint32(entry + 4) };
+    const auto info = FileInfo{
+      read_uint64(entry + 16),
+      read_uint64(entry + 24),
+      static_cast<time_t>(read_uint64(entry + 32)),
+      0,
+      i,
+      read_uint64(entry + 8),
+      static_cast<int>(read_uint32(entry + 40)),
+      read_uint32(entry + 44),
+    };
+    if (filename_offset + filename_size > index_size ||
+        !info.data_offset ||
+        info.data_offset + info.compressed_size > index_offset ||
+        (info.compression_method != 0 && info.compression_method != Z_DEFLATED))
+      return false;
+
+    const auto filename = index.substr(static_cast<size_t>(filename_offset),
+      static_cast<size_t>(filename_size));
+    if (!only_root || is_root_filename(filename))
+      contents.insert(filename, info);
+  }
+  m_contents = std::move(contents);
+  return true;
+}
+
+void ArchiveReader::read_aliases() {
+  auto buffer = ByteVector();
+  const auto data = as_string_view(do_read(m_contents.find(aliases_filename), buffer));
+
+  // target filename followed by its aliases, which are indented by a tab
+  auto target = std::optional<FileInfo>();
+  for (auto begin = size_t{ }; begin < data.size(); ) {
+    auto end = data.find("\r\n", begin);
+    if (end == std::string_view::npos)
+      end = data.size();
+    const auto line = data.substr(begin, end - begin);
+    begin = end + 2;
+
+    if (line.empty())
+      continue;
+    if (line.front() != '\t') {
+      const auto info = m_contents.find(line);
+      target = (info ? std::make_optional(*info) : std::nullopt);
+    }
+    else if (target) {
+      m_contents.insert(line.substr(1), target.value());
+    }
+  }
+}
+
+bool ArchiveReader::has_aliases() const {
+  return m_contents.contains(aliases_filename);
+}
+
 void ArchiveReader::for_each_file(const std::function<void(std::string)>& callback) const {
-  for (const auto& [filename, info] : m_contents)
-    callback(filename.data());
+  m_contents.for_each([&](std::string_view filename, const FileInfo&) {
+    callback(std::string(filename));
+  });
 }
 
 //-------------------------------------------------------------------------
 
+struct ArchiveWriter::ZipStream {
+  zlib_filefunc64_def base;
+  voidpf stream;
+};
+
+struct ArchiveWriter::CompressedEntry {
+  ByteView data;
+  ByteVector buffer;
+  int method;
+  uint32_t crc32;
+  uint64_t uncompressed_size;
+};
+
 ArchiveWriter::ArchiveWriter() = default;
 
 ArchiveWriter::~ArchiveWriter() {
@@ -263,14 +768,38 @@ void ArchiveWriter::set_lossy_compressor(
   m_lossy_compressor = std::move(lossy_compressor);
 }
 
-bool ArchiveWriter::open(std::filesystem::path filename) {
+void ArchiveWriter::set_compression_level(int level) {
+  m_compression_level = std::clamp(level, 0, 9);
+}
+
+void ArchiveWriter::set_deduplicate(bool deduplicate) {
+  m_deduplicate = deduplicate;
+}
+
+bool ArchiveWriter::open(std::filesystem::path filename, bool append,
+    const std::vector<std::string>& superseded_files) {
   if (!m_filename.empty() || filename.empty())
     return false;
 
-  m_filename = std::move(filename);
-  if (!reopen(false)) {
-    m_filename.clear();
-    return false;
+  if (append) {
+    // original stays valid until the copy replaces it
+    m_filename = generate_temporary_filename("webrecorder-");
+    if (!copy_for_append(filename, superseded_files) || !do_open(true)) {
+      auto error = std::error_code{ };
+      std::filesystem::remove(m_filename, error);
+      m_filename.clear();
+      m_written.clear();
+      m_archive_entry_count = 0;
+      return false;
+    }
+    move_on_close(std::move(filename), true);
+  }
+  else {
+    m_filename = std::move(filename);
+    if (!do_open(false)) {
+      m_filename.clear();
+      return false;
+    }
   }
   start_thread();
   return true;
@@ -298,11 +827,16 @@ bool ArchiveWriter::close() {
   return true;
 }
 
+void ArchiveWriter::flush() {
+  finish_thread();
+  start_thread();
+}
+
 std::optional<time_t> ArchiveWriter::get_modification_time(
     const std::string& filename) const {
   assert(is_valid_filename(filename));
-  if (auto it = m_contents.find(filename); it != m_contents.end())
-    return it->second;
+  if (auto modification_time = m_contents.find(filename))
+    return *modification_time;
   return std::nullopt;
 }
 
@@ -313,7 +847,7 @@ bool ArchiveWriter::contains(const std::string& filename) const {
 bool ArchiveWriter::update_contents(const std::string& filename,
     time_t modification_time) {
   assert(is_valid_filename(filename));
-  return m_contents.try_emplace(filename, modification_time).second;
+  return m_contents.insert(filename, modification_time);
 }
 
 bool ArchiveWriter::write(const std::string& filename, ByteView data,
@@ -321,7 +855,8 @@ bool ArchiveWriter::write(const std::string& filename, ByteView data,
   if (!update_contents(filename, modification_time))
     return false;
 
-  return do_write(filename, data, modification_time, allow_lossy_compression);
+  return do_write(filename,
+    compress(filename, data, allow_lossy_compression), modification_time);
 }
 
 void ArchiveWriter::async_write(const std::string& filename, ByteView data,
@@ -330,9 +865,49 @@ void ArchiveWriter::async_write(const std::string& filename, ByteView data,
   if (!update_contents(filename, modification_time))
     return on_complete(false);
 
+  // compress in parallel, but append to archive in order
+  auto task = std::make_shared<std::packaged_task<CompressedEntry()>>(
+    [this, filename, data, allow_lossy_compression]() {
+      return compress(filename, data, allow_lossy_compression);
+    });
   insert_task([this, filename, data, modification_time,
-      allow_lossy_compression, on_complete = std::move(on_complete)]() {
-    on_complete(do_write(filename, data, modification_time, allow_lossy_compression));
+      entry = task->get_future().share(),
+      on_complete = std::move(on_complete)]() {
+    // deflated entries were not lossy compressed
+    const auto& compressed = entry.get();
+    on_complete(write_or_alias(filename, compressed,
+      (compressed.method == Z_DEFLATED ? data : compressed.data),
+      modification_time));
+  });
+  m_compression_pool.post([task]() { (*task)(); });
+}
+
+void ArchiveWriter::async_write(const std::string& filename,
+    const DeflateStream& deflated, time_t modification_time,
+    std::function<void(bool)>&& on_complete) {
+  if (!update_contents(filename, modification_time))
+    return on_complete(false);
+
+  insert_task([this, filename, deflated, modification_time,
+      on_complete = std::move(on_complete)]() {
+    on_complete(write_or_alias(filename, CompressedEntry{
+      deflated.data, { }, Z_DEFLATED, deflated.crc32,
+      deflated.uncompressed_size }, std::nullopt, modification_time));
+  });
+}
+
+void ArchiveWriter::async_write_raw(const std::string& filename, ByteView data,
+    int compression_method, uint32_t crc32, uint64_t uncompressed_size,
+    time_t modification_time, std::function<void(bool)>&& on_complete) {
+  if (!update_contents(filename, modification_time))
+    return on_complete(false);
+
+  insert_task([this, filename, data, compression_method, crc32,
+      uncompressed_size, modification_time, on_complete = std::move(on_complete)]() {
+    on_complete(write_or_alias(filename, CompressedEntry{ data, { },
+      compression_method, crc32, uncompressed_size },
+      (compression_method == Z_DEFLATED ? std::nullopt : std::optional(data)),
+      modification_time));
   });
 }
 
@@ -346,52 +921,206 @@ void ArchiveWriter::async_read(const std::string& filename,
 }
 
 void ArchiveWriter::do_close() {
-  if (m_reading)
-    ::unzClose(m_zip);
-  else
-    ::zipClose(m_zip, nullptr);
+  if (m_zip) {
+    write_aliases();
+    const auto comment = write_index();
+    ::zipClose(m_zip, comment.empty() ? nullptr : comment.c_str());
+  }
   m_zip = nullptr;
+  m_written.clear();
+  m_archive_entry_count = 0;
+  m_content_keys.clear();
 }
 
-bool ArchiveWriter::reopen(bool for_reading) {
-  if (m_zip && for_reading == m_reading)
-    return true;
-  const auto write_mode =
-    (m_zip ? APPEND_STATUS_ADDINZIP : APPEND_STATUS_CREATE);
-  do_close();
-  m_reading = for_reading;
+bool ArchiveWriter::copy_for_append(const std::filesystem::path& filename,
+    const std::vector<std::string>& superseded_files) {
+  auto mapped_file = MappedFile();
+  if (!mapped_file.open(filename))
+    return false;
+  const auto file = mapped_file.data();
+  const auto directory = find_central_directory(file);
+  if (!directory)
+    return false;
+
+  auto headers = std::vector<std::pair<CentralHeader, uint64_t>>();
+  auto offset = directory->offset;
+  for (auto i = uint64_t{ }; i < directory->entry_count; ++i) {
+    const auto header = read_central_header(file, offset);
+    if (!header)
+      return false;
+    headers.emplace_back(*header, offset);
+    offset += header->size;
+  }
+
+  // superseded files are written on close, so the last ones trail the data
+  const auto is_superseded = [&](std::string_view filename) {
+    return (filename == index_filename || filename == aliases_filename ||
+      std::find(superseded_files.begin(), superseded_files.end(),
+        filename) != superseded_files.end());
+  };
+  auto by_offset = std::vector<const CentralHeader*>();
+  for (const auto& [header, header_offset] : headers)
+    by_offset.push_back(&header);
+  std::sort(by_offset.begin(), by_offset.end(),
+    [](const auto* a, const auto* b) {
+      return a->local_header_offset < b->local_header_offset;
+    });
+  auto data_end = directory->offset;
+  for (auto it = by_offset.rbegin(); it != by_offset.rend() &&
+      is_superseded((*it)->filename); ++it)
+    data_end = (*it)->local_header_offset;
+
+  auto reader = ArchiveReader();
+  if (!reader.open(filename))
+    return false;
+
+  // all entries need to be mapped, so they can be put in index
+  auto entries = std::vector<std::pair<std::string, ArchiveReader::FileInfo>>();
+  auto succeeded = true;
+  reader.for_each_file([&](std::string filename) {
+    if (filename == index_filename || filename == aliases_filename)
+      return;
+    const auto info = reader.get_file_info(filename);
+    if (!info || !info->data_offset) {
+      succeeded = false;
+      return;
+    }
+    // keep all files, when an alias references dropped data
+    if (info->data_offset >= data_end && !is_superseded(filename))
+      data_end = directory->offset;
+    entries.emplace_back(std::move(filename), *info);
+  });
+  if (!succeeded)
+    return false;
+
+  for (const auto& [filename, info] : entries)
+    if (info.data_offset < data_end)
+      m_written.insert(filename, WrittenEntry{
+        info.data_offset,
+        info.compressed_size,
+        info.uncompressed_size,
+        info.compression_method,
+        info.crc32,
+        info.modification_time,
+      });
+
+  // copy data and central directory of kept entries
+  auto central_directory = std::string();
+  auto entry_count = uint64_t{ };
+  for (const auto& [header, header_offset] : headers)
+    if (header.local_header_offset < data_end) {
+      central_directory.append(reinterpret_cast<const char*>(
+        file.data() + header_offset), static_cast<size_t>(header.size));
+      ++entry_count;
+    }
+  const auto directory_size = static_cast<uint64_t>(central_directory.size());
+  const auto zip64 = (entry_count >= 0xFFFF ||
+    data_end >= 0xFFFFFFFF || directory_size >= 0xFFFFFFFF);
+
+  auto end = std::string(zip64 ? 56 + 20 + 22 : 22, '\0');
+  auto end_offset = size_t{ };
+  if (zip64) {
+    write_uint32(end, 0, 0x06064b50);
+    write_uint64(end, 4, 56 - 12);
+    write_uint16(end, 12, 45);
+    write_uint16(end, 14, 45);
+    write_uint64(end, 24, entry_count);
+    write_uint64(end, 32, entry_count);
+    write_uint64(end, 40, directory_size);
+    write_uint64(end, 48, data_end);
+    write_uint32(end, 56, 0x07064b50);
+    write_uint64(end, 64, data_end + directory_size);
+    write_uint32(end, 72, 1);
+    end_offset = 56 + 20;
+  }
+  write_uint32(end, end_offset, 0x06054b50);
+  write_uint16(end, end_offset + 8, std::min(entry_count, uint64_t{ 0xFFFF }));
+  write_uint16(end, end_offset + 10, std::min(entry_count, uint64_t{ 0xFFFF }));
+  write_uint32(end, end_offset + 12, std::min(directory_size, uint64_t{ 0xFFFFFFFF }));
+  write_uint32(end, end_offset + 16, std::min(data_end, uint64_t{ 0xFFFFFFFF }));
+
+  auto stream = std::ofstream(m_filename, std::ios::binary);
+  stream.write(reinterpret_cast<const char*>(file.data()),
+    static_cast<std::streamsize>(data_end));
+  stream.write(central_directory.data(),
+    static_cast<std::streamsize>(central_directory.size()));
+  stream.write(end.data(), static_cast<std::streamsize>(end.size()));
+  stream.close();
+  if (!stream.good())
+    return false;
+
+  m_archive_entry_count = entry_count;
+  return true;
+}
 
+bool ArchiveWriter::do_open(bool append) {
+  m_zip_stream = std::make_unique<ZipStream>();
+  auto& base = m_zip_stream->base;
 #if defined(_WIN32)
-  auto filefunc = zlib_filefunc64_def{ };
-  ::fill_win32_filefunc64W(&filefunc);
-  m_zip = (m_reading ?
-    ::unzOpen2_64(m_filename.wstring().c_str(), &filefunc) :
-    ::zipOpen2_64(m_filename.wstring().c_str(),
-      write_mode, nullptr, &filefunc));
+  ::fill_win32_filefunc64W(&base);
+  const auto filename = m_filename.wstring();
 # else
-  m_zip = (m_reading ?
-    ::unzOpen64(m_filename.c_str()) :
-    ::zipOpen(m_filename.c_str(), write_mode));
+  ::fill_fopen64_filefunc(&base);
+  const auto filename = m_filename.string();
 #endif
+
+  // forward to base functions, which do not use opaque,
+  // but keep stream so written entries can be read back
+  auto filefunc = base;
+  filefunc.opaque = m_zip_stream.get();
+  filefunc.zopen64_file = [](voidpf opaque, const void* filename, int mode) -> voidpf {
+    auto& zip_stream = *static_cast<ZipStream*>(opaque);
+    auto& base = zip_stream.base;
+    if (mode & ZLIB_FILEFUNC_MODE_CREATE) {
+      // create empty file and reopen it for reading and writing
+      auto stream = base.zopen64_file(base.opaque, filename, mode);
+      if (!stream)
+        return nullptr;
+      base.zclose_file(base.opaque, stream);
+      mode = ZLIB_FILEFUNC_MODE_READ | ZLIB_FILEFUNC_MODE_WRITE |
+        ZLIB_FILEFUNC_MODE_EXISTING;
+    }
+    zip_stream.stream = base.zopen64_file(base.opaque, filename, mode);
+    return zip_stream.stream;
+  };
+  // when appending, new entries and central directory replace the old central directory
+  m_zip = ::zipOpen2_64(filename.c_str(),
+    (append ? APPEND_STATUS_ADDINZIP : APPEND_STATUS_CREATE), nullptr, &filefunc);
   return (m_zip != nullptr);
 }
 
-bool ArchiveWriter::do_write(const std::string& filename, ByteView data,
-    time_t modification_time, bool allow_lossy_compression) {
-  auto lock = std::lock_guard(m_zip_mutex);
-  if (!reopen(false))
-    return false;
-
-  auto lossless_compression = is_likely_compressible(filename);
+auto ArchiveWriter::compress(const std::string& filename, ByteView data,
+    bool allow_lossy_compression) const -> CompressedEntry {
+  auto entry = CompressedEntry{ data, { }, 0, 0, data.size() };
+  auto lossless_compression = (m_compression_level != 0 &&
+    is_likely_compressible(filename));
 
-  auto lossy_compressed_data = std::optional<ByteVector>();
   if (allow_lossy_compression && m_lossy_compressor) {
-    lossy_compressed_data = m_lossy_compressor->try_compress(data);
-    if (lossy_compressed_data.has_value()) {
-      data = lossy_compressed_data.value();
+    if (auto lossy_compressed_data = m_lossy_compressor->try_compress(data)) {
+      entry.buffer = std::move(lossy_compressed_data.value());
+      entry.data = entry.buffer;
+      entry.uncompressed_size = entry.data.size();
       lossless_compression = false;
     }
   }
+  entry.crc32 = get_crc32(entry.data);
+
+  if (lossless_compression) {
+    auto buffer = ByteVector();
+    if (deflate_raw(entry.data, buffer, m_compression_level)) {
+      entry.buffer = std::move(buffer);
+      entry.data = entry.buffer;
+      entry.method = Z_DEFLATED;
+    }
+  }
+  return entry;
+}
+
+bool ArchiveWriter::do_write(const std::string& filename,
+    const CompressedEntry& entry, time_t modification_time) {
+  auto lock = std::lock_guard(m_zip_mutex);
+  if (!m_zip)
+    return false;
 
   if (!modification_time)
     modification_time = std::time(nullptr);
@@ -399,37 +1128,195 @@ bool ArchiveWriter::do_write(const std::string& filename, ByteView data,
     to_tm_zip(modification_time),
     0, 0, 0,
   };
-  if (::zipOpenNewFileInZip(m_zip, filename.c_str(),
+  // entries are already compressed, write them as they are
+  if (::zipOpenNewFileInZip2(m_zip, filename.c_str(),
       &info, nullptr, 0, nullptr, 0, nullptr,
-      Z_DEFLATED, (lossless_compression ?
-        Z_DEFAULT_COMPRESSION : Z_NO_COMPRESSION)) != ZIP_OK)
+      entry.method, Z_DEFAULT_COMPRESSION, 1) != ZIP_OK)
+    return false;
+
+  const auto& base = m_zip_stream->base;
+  const auto data_offset = base.ztell64_file(base.opaque, m_zip_stream->stream);
+
+  ::zipWriteInFileInZip(m_zip, entry.data.data(),
+    static_cast<unsigned int>(entry.data.size()));
+  if (::zipCloseFileInZipRaw(m_zip,
+      static_cast<uLong>(entry.uncompressed_size), entry.crc32) != ZIP_OK)
+    return false;
+
+  ++m_archive_entry_count;
+  m_written.insert_or_assign(filename, WrittenEntry{
+    data_offset,
+    entry.data.size(),
+    entry.uncompressed_size,
+    entry.method,
+    entry.crc32,
+    modification_time,
+  });
+  return true;
+}
+
+bool ArchiveWriter::do_write_alias(const std::string& filename,
+    const std::string& target, time_t modification_time) {
+  auto lock = std::lock_guard(m_zip_mutex);
+  const auto entry = m_written.find(target);
+  if (!m_zip || !entry)
     return false;
 
-  ::zipWriteInFileInZip(m_zip, data.data(),
-    static_cast<unsigned int>(data.size()));
-  ::zipCloseFileInZip(m_zip);
+  auto alias = *entry;
+  alias.modification_time =
+    (modification_time ? modification_time : std::time(nullptr));
+  m_written.insert_or_assign(filename, alias);
   return true;
 }
 
+bool ArchiveWriter::write_or_alias(const std::string& filename,
+    const CompressedEntry& entry, std::optional<ByteView> uncompressed,
+    time_t modification_time) {
+  if (!m_deduplicate)
+    return do_write(filename, entry, modification_time);
+
+  // files are identified by their uncompressed content
+  const auto content_key = ((uint64_t{ entry.crc32 } << 32) ^ entry.uncompressed_size);
+  if (auto target = find_duplicate(content_key, entry, uncompressed))
+    return do_write_alias(filename, target.value(), modification_time);
+
+  if (!do_write(filename, entry, modification_time))
+    return false;
+  m_content_keys.emplace(content_key, filename);
+  return true;
+}
+
+std::optional<std::string> ArchiveWriter::find_duplicate(uint64_t content_key,
+    const CompressedEntry& entry, std::optional<ByteView> uncompressed) {
+  const auto equal = [](ByteView a, ByteView b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+  };
+  auto inflated = ByteVector();
+  const auto [begin, end] = m_content_keys.equal_range(content_key);
+  for (auto it = begin; it != end; ++it) {
+    auto lock = std::lock_guard(m_zip_mutex);
+    const auto target = m_written.find(it->second);
+    if (!target || target->crc32 != entry.crc32 ||
+        target->uncompressed_size != entry.uncompressed_size)
+      continue;
+
+    // a matching key is not sufficient, the content has to be compared
+    if (target->method == entry.method &&
+        target->compressed_size == entry.data.size() &&
+        equal(read_written(*target, false), entry.data))
+      return it->second;
+
+    if (!uncompressed) {
+      inflated.resize(entry.uncompressed_size);
+      if (entry.method != Z_DEFLATED || !inflate_raw(entry.data, inflated))
+        return std::nullopt;
+      uncompressed = inflated;
+    }
+    if (equal(read_written(*target, true), uncompressed.value()))
+      return it->second;
+  }
+  return std::nullopt;
+}
+
+void ArchiveWriter::write_aliases() {
+  // aliases share the data offset of their target, which was written before
+  auto targets = std::unordered_map<uint64_t, std::string_view>();
+  auto aliases = std::map<std::string_view, std::vector<std::string_view>>();
+  m_written.for_each([&](std::string_view filename, const WrittenEntry& entry) {
+    const auto [it, inserted] = targets.emplace(entry.data_offset, filename);
+    if (!inserted)
+      aliases[it->second].push_back(filename);
+  });
+  if (aliases.empty())
+    return;
+
+  auto data = std::string();
+  for (const auto& [target, filenames] : aliases) {
+    data.append(target).append("\r\n");
+    for (const auto& filename : filenames)
+      data.append("\t").append(filename).append("\r\n");
+  }
+  const auto view = as_byte_view(data);
+  do_write(aliases_filename, CompressedEntry{ view, { }, 0,
+    get_crc32(view), view.size() }, 0);
+}
+
+std::string ArchiveWriter::write_index() {
+  if (m_written.contains(index_filename))
+    return { };
+
+  auto filenames_size = size_t{ };
+  m_written.for_each([&](std::string_view filename, const WrittenEntry&) {
+    filenames_size += filename.size();
+  });
+  auto index = std::string(index_magic);
+  index.resize(index_header_size + m_written.size() * index_entry_size);
+  write_uint32(index, 4, index_version);
+  write_uint32(index, 8, m_written.size());
+  write_uint32(index, 12, m_archive_entry_count);
+  index.reserve(index.size() + filenames_size);
+
+  auto offset = index_header_size;
+  m_written.for_each([&](std::string_view filename, const WrittenEntry& entry) {
+    write_uint32(index, offset, index.size());
+    write_uint32(index, offset + 4, filename.size());
+    write_uint64(index, offset + 8, entry.data_offset);
+    write_uint64(index, offset + 16, entry.compressed_size);
+    write_uint64(index, offset + 24, entry.uncompressed_size);
+    // store time as it is read back from central directory
+    auto time = to_tm_zip(entry.modification_time);
+    time.tm_sec &= ~1u;
+    write_uint64(index, offset + 32, static_cast<uint64_t>(to_time_t(time)));
+    write_uint32(index, offset + 40, static_cast<uint64_t>(entry.method));
+    write_uint32(index, offset + 44, entry.crc32);
+    index.append(filename);
+    offset += index_entry_size;
+  });
+
+  const auto data = as_byte_view(index);
+  if (!do_write(index_filename, CompressedEntry{ data, { }, 0,
+        get_crc32(data), data.size() }, 0))
+    return { };
+
+  const auto entry = m_written.find(index_filename);
+  return std::string(index_magic) + " " + std::to_string(entry->data_offset) +
+    " " + std::to_string(index.size());
+}
 
 std::pair<ByteVector, time_t> ArchiveWriter::do_read(const std::string& filename) {
   auto lock = std::lock_guard(m_zip_mutex);
-  if (!reopen(true))
+  const auto entry = m_written.find(filename);
+  if (!m_zip || !entry)
     return { };
+  return std::make_pair(read_written(*entry, true), entry->modification_time);
+}
 
-  if (::unzLocateFile(m_zip, filename.c_str(), 0) != UNZ_OK ||
-      ::unzOpenCurrentFile(m_zip) != UNZ_OK)
+// m_zip_mutex has to be locked
+ByteVector ArchiveWriter::read_written(const WrittenEntry& entry, bool inflate) {
+  if (!m_zip)
     return { };
 
-  auto info = unz_file_info{ };
-  ::unzGetCurrentFileInfo(m_zip, &info,
-    nullptr, 0, nullptr, 0, nullptr, 0);
-  auto buffer = ByteVector(info.uncompressed_size);
-  ::unzReadCurrentFile(m_zip, buffer.data(),
-    static_cast<unsigned int>(info.uncompressed_size));
-  ::unzCloseCurrentFile(m_zip);
+  // read from the file written to, then continue writing at its end
+  const auto& base = m_zip_stream->base;
+  const auto stream = m_zip_stream->stream;
+  auto buffer = ByteVector(entry.compressed_size);
+  const auto position = base.ztell64_file(base.opaque, stream);
+  auto guard = std::shared_ptr<void>(nullptr, [&](auto) {
+    base.zseek64_file(base.opaque, stream, position, ZLIB_FILEFUNC_SEEK_SET);
+  });
+  if (base.zseek64_file(base.opaque, stream, entry.data_offset,
+        ZLIB_FILEFUNC_SEEK_SET) != 0 ||
+      base.zread_file(base.opaque, stream, buffer.data(),
+        static_cast<uLong>(buffer.size())) != buffer.size())
+    return { };
 
-  return std::make_pair(std::move(buffer), to_time_t(info.tmu_date));
+  if (inflate && entry.method == Z_DEFLATED) {
+    auto inflated = ByteVector(entry.uncompressed_size);
+    if (!inflate_raw(buffer, inflated))
+      return { };
+    buffer = std::move(inflated);
+  }
+  return buffer;
 }
 
 void ArchiveWriter::insert_task(std::function<void()>&& task) {
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "common.h"
+#include "platform.h"
+#include "FileIndex.h"
+#include "ThreadPool.h"
 #include <functional>
-#include <map>
 #include <deque>
 #include <filesystem>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <optional>
+#include <array>
+#include <atomic>
+#include <unordered_map>
 
 class ILossyCompressor;
 
@@ -22,6 +27,11 @@ public:
 
     uint64_t directory_entry;
     uint64_t file_index;
+
+    // position of data in mapped file, 0 when unknown
+    uint64_t data_offset;
+    int compression_method;
+    uint32_t crc32;
   };
 
   enum FileVersion {
@@ -36,6 +46,8 @@ public:
   ~ArchiveReader();
 
   void set_overlay_path(std::string path);
+  // number of unzip contexts opened in advance, one per reading thread
+  void set_context_count(size_t count);
   bool open(const std::filesystem::path& filename);
   bool open_root(const std::filesystem::path& filename);
   void close();
@@ -44,21 +56,39 @@ public:
     const std::string& filename, FileVersion version = top) const;
   ByteVector read(const std::string& filename,
     FileVersion version = top) const;
+  // returns view into the mapped file or into the passed buffer
+  ByteView read(const std::string& filename, ByteVector& buffer,
+    FileVersion version = top) const;
+
+  // returns view of compressed data in the mapped file, empty when unavailable
+  ByteView read_raw(const std::string& filename,
+    FileVersion version = top) const;
 
   void for_each_file(const std::function<void(std::string)>& callback) const;
+  // whether files share their data with others, see ArchiveWriter::set_deduplicate
+  bool has_aliases() const;
 
 private:
   bool read_contents(bool only_root);
+  bool read_contents_unzip(bool only_root);
+  bool read_central_directory(bool only_root);
+  bool read_index(bool only_root);
+  void read_aliases();
+  void warm_contexts();
+  void* open_context() const;
   void* acquire_context() const;
   void return_context(void* context) const;
-  std::optional<FileInfo> do_get_file_info(const std::string& filename) const;
-  ByteVector do_read(const std::string& filename) const;
+  ByteView do_read(const FileInfo* info, ByteVector& buffer) const;
+  ByteView do_read_mapped(const FileInfo& info, ByteVector& buffer) const;
+  ByteView do_read_unzip(const FileInfo& info, ByteVector& buffer) const;
 
   std::filesystem::path m_filename;
+  MappedFile m_mapped_file;
   std::string m_overlay_path;
-  mutable std::mutex m_mutex;
-  mutable std::vector<void*> m_unzip_contexts;
-  std::map<std::string, FileInfo> m_contents;
+  size_t m_context_count{ 1 };
+  // lock-free pool, one context per slot
+  mutable std::array<std::atomic<void*>, 16> m_unzip_contexts{ };
+  FileIndex<FileInfo> m_contents;
 };
 
 //-------------------------------------------------------------------------
@@ -71,27 +101,67 @@ public:
   ~ArchiveWriter();
 
   void set_lossy_compressor(std::unique_ptr<ILossyCompressor> lossy_compressor);
-  bool open(std::filesystem::path filename);
+  // deflate level of compressible files, 0 stores them
+  void set_compression_level(int level);
+  // store files with identical content only once
+  void set_deduplicate(bool deduplicate);
+  // when appending, entries of an existing archive can be replaced,
+  // a copy is written, which replaces the archive when it is closed.
+  // superseded files, which were written last, are not copied
+  bool open(std::filesystem::path filename, bool append = false,
+    const std::vector<std::string>& superseded_files = { });
   bool is_open() const { return !m_filename.empty(); }
   void move_on_close(std::filesystem::path filename, bool overwrite);
   bool close();
+  void flush();
   bool write(const std::string& filename, ByteView data,
     time_t modification_time = 0, bool allow_lossy_compression = false);
   void async_write(const std::string& filename, ByteView data,
     time_t modification_time, bool allow_lossy_compression,
     std::function<void(bool)>&& on_complete);
+  void async_write(const std::string& filename, const DeflateStream& deflated,
+    time_t modification_time, std::function<void(bool)>&& on_complete);
+  // writes already compressed data as it is
+  void async_write_raw(const std::string& filename, ByteView data,
+    int compression_method, uint32_t crc32, uint64_t uncompressed_size,
+    time_t modification_time, std::function<void(bool)>&& on_complete);
   bool contains(const std::string& filename) const;
   std::optional<time_t> get_modification_time(const std::string& filename) const;
   void async_read(const std::string& filename,
     std::function<void(ByteVector, time_t)>&& on_complete);
 
 private:
+  struct CompressedEntry;
+  struct ZipStream;
+
+  struct WrittenEntry {
+    uint64_t data_offset;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    int method;
+    uint32_t crc32;
+    time_t modification_time;
+  };
+
   bool update_contents(const std::string& filename, time_t modification_time);
-  bool reopen(bool for_reading);
+  bool copy_for_append(const std::filesystem::path& filename,
+    const std::vector<std::string>& superseded_files);
+  bool do_open(bool append);
   void do_close();
-  bool do_write(const std::string& filename, ByteView data,
-    time_t modification_time, bool allow_lossy_compression);
+  CompressedEntry compress(const std::string& filename, ByteView data,
+    bool allow_lossy_compression) const;
+  bool do_write(const std::string& filename, const CompressedEntry& entry,
+    time_t modification_time);
+  bool do_write_alias(const std::string& filename, const std::string& target,
+    time_t modification_time);
+  bool write_or_alias(const std::string& filename, const CompressedEntry& entry,
+    std::optional<ByteView> uncompressed, time_t modification_time);
   std::pair<ByteVector, time_t> do_read(const std::string& filename);
+  ByteVector read_written(const WrittenEntry& entry, bool inflate);
+  std::optional<std::string> find_duplicate(uint64_t content_key,
+    const CompressedEntry& entry, std::optional<ByteView> uncompressed);
+  void write_aliases();
+  std::string write_index();
 
   void insert_task(std::function<void()>&& task);
   void start_thread();
@@ -101,16 +171,24 @@ private:
   std::filesystem::path m_filename;
   std::filesystem::path m_move_on_close;
   bool m_overwrite{ };
-  std::map<std::string, time_t> m_contents;
+  FileIndex<time_t> m_contents;
 
   std::mutex m_zip_mutex;
   std::unique_ptr<ILossyCompressor> m_lossy_compressor;
+  int m_compression_level{ 6 };
+  std::unique_ptr<ZipStream> m_zip_stream;
   void* m_zip{ };
-  bool m_reading{ };
+  FileIndex<WrittenEntry> m_written;
+  uint64_t m_archive_entry_count{ };
+
+  bool m_deduplicate{ };
+  // only accessed by writer thread
+  std::unordered_multimap<uint64_t, std::string> m_content_keys;
 
   std::mutex m_tasks_mutex;
   std::condition_variable m_tasks_signal;
   std::deque<std::function<void()>> m_tasks;
   bool m_finish_thread{ };
   std::thread m_thread;
+  ThreadPool m_compression_pool;
 };
@@ -2,39 +2,168 @@
 #include "Client.h"
 #include "libs/SimpleWeb/client_http.hpp"
 #include "libs/SimpleWeb/client_https.hpp"
-#include "libs/zstr/zstr.hpp"
+#include "zlib.h"
+#include <algorithm>
 #include <variant>
+#include <atomic>
+#include <map>
 
 using HttpClient = SimpleWeb::Client<SimpleWeb::HTTP>;
-using HttpsClient = SimpleWeb::Client<SimpleWeb::HTTPS>;
 
 extern std::shared_ptr<asio::io_service> sole_io_service();
 
 namespace {
-  class GrowBuffer {
+  // keeps the last TLS session of each host, so new connections
+  // can resume it instead of performing a full handshake
+  class TlsSessionCache {
   public:
-    GrowBuffer() = default;
-    GrowBuffer(const GrowBuffer&) = delete;
-    GrowBuffer& operator=(const GrowBuffer&) = delete;
-    ~GrowBuffer() {
-      std::free(m_data);
+    TlsSessionCache() = default;
+    TlsSessionCache(const TlsSessionCache&) = delete;
+    TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+    ~TlsSessionCache() {
+      for (const auto& [hostname, session] : m_sessions)
+        ::SSL_SESSION_free(session);
     }
-    std::byte* data() {
-      return m_data;
+
+    // takes ownership of session
+    void set(const std::string& hostname, SSL_SESSION* session) {
+      auto lock = std::lock_guard(m_mutex);
+      auto& current = m_sessions[hostname];
+      if (current)
+        ::SSL_SESSION_free(current);
+      current = session;
+    }
+
+    // every connection gets its own copy of the session
+    void apply(SSL* ssl, const std::string& hostname) const {
+      auto lock = std::lock_guard(m_mutex);
+      if (auto it = m_sessions.find(hostname); it != m_sessions.end())
+        if (auto session = ::SSL_SESSION_dup(it->second)) {
+          ::SSL_set_session(ssl, session);
+          ::SSL_SESSION_free(session);
+        }
     }
-    std::streamsize capacity() const {
-      return m_capacity;
+
+  private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, SSL_SESSION*, std::less<>> m_sessions;
+  };
+
+  class HttpsClient final : public SimpleWeb::Client<SimpleWeb::HTTPS> {
+  public:
+    HttpsClient(const std::string& hostname_port,
+        std::shared_ptr<TlsSessionCache> session_cache)
+      : Client(hostname_port, false),
+        m_session_cache(std::move(session_cache)) {
+      const auto ctx = context.native_handle();
+      SSL_CTX_set_session_cache_mode(ctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      ::SSL_CTX_set_ex_data(ctx, session_cache_index(), m_session_cache.get());
+      ::SSL_CTX_sess_set_new_cb(ctx, &HttpsClient::handle_new_session);
     }
-    void grow() {
-      m_capacity = std::max(std::streamsize{ 4096 }, m_capacity * 2);
-      m_data = static_cast<std::byte*>(
-        std::realloc(m_data, static_cast<size_t>(m_capacity)));
+
+  protected:
+    std::shared_ptr<Connection> create_connection() noexcept override {
+      auto connection = Client::create_connection();
+      m_session_cache->apply(connection->socket->native_handle(), host);
+      return connection;
     }
 
   private:
-    std::byte* m_data{ };
-    std::streamsize m_capacity{ };
+    // app data is already used by asio
+    static int session_cache_index() {
+      static const auto s_index = SSL_CTX_get_ex_new_index(
+        0, nullptr, nullptr, nullptr, nullptr);
+      return s_index;
+    }
+
+    static int handle_new_session(SSL* ssl, SSL_SESSION* session) {
+      const auto session_cache = static_cast<TlsSessionCache*>(
+        ::SSL_CTX_get_ex_data(::SSL_get_SSL_CTX(ssl), session_cache_index()));
+      const auto hostname = ::SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+      if (!session_cache || !hostname)
+        return 0;
+      // store a copy, connections which are not shut down cleanly
+      // mark their session as not resumable
+      if (auto copy = ::SSL_SESSION_dup(session))
+        session_cache->set(hostname, copy);
+      return 0;
+    }
+
+    std::shared_ptr<TlsSessionCache> m_session_cache;
   };
+
+  // the trailer of a gzip stream contains the uncompressed size modulo 2^32
+  size_t get_gzip_size_hint(ByteView data) {
+    if (data.size() < 18)
+      return 0;
+    const auto trailer = reinterpret_cast<const uint8_t*>(
+      data.data() + data.size() - 4);
+    const auto size = static_cast<size_t>(trailer[0]) |
+      static_cast<size_t>(trailer[1]) << 8 |
+      static_cast<size_t>(trailer[2]) << 16 |
+      static_cast<size_t>(trailer[3]) << 24;
+    // the size is not trusted, the buffer grows while inflating
+    const auto max_size_hint = size_t{ 4 << 20 };
+    return std::min({ size, data.size() * 16, max_size_hint });
+  }
+
+  bool is_gzip_header(const z_stream& stream) {
+    return (stream.avail_in >= 2 &&
+      stream.next_in[0] == 0x1F && stream.next_in[1] == 0x8B);
+  }
+
+  bool inflate_gzip(ByteView data, ByteVector& output) {
+    auto stream = z_stream{ };
+    if (::inflateInit2(&stream, 15 + 16) != Z_OK)
+      return false;
+    auto guard = std::shared_ptr<void>(nullptr, [&](auto) { ::inflateEnd(&stream); });
+
+    output.resize(get_gzip_size_hint(data));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    auto size = size_t{ };
+    for (;;) {
+      if (size == output.size())
+        output.resize(std::max(size_t{ 4096 }, size * 2));
+      stream.next_out = reinterpret_cast<Bytef*>(output.data() + size);
+      stream.avail_out = static_cast<uInt>(output.size() - size);
+      const auto result = ::inflate(&stream, Z_NO_FLUSH);
+      size = output.size() - stream.avail_out;
+
+      if (result == Z_STREAM_END) {
+        // continue with concatenated members, ignore trailing garbage
+        if (!is_gzip_header(stream))
+          break;
+        ::inflateReset(&stream);
+      }
+      else if (result != Z_OK || stream.avail_in == 0) {
+        return false;
+      }
+    }
+    output.resize(size);
+    return true;
+  }
+
+  template<typename T>
+  ByteView get_content(T& response) {
+    // content was not consumed yet, so it is the whole input sequence
+    const auto streambuf = static_cast<asio::streambuf*>(response.content.rdbuf());
+    const auto buffer = streambuf->data();
+    return { static_cast<const std::byte*>(buffer.data()), buffer.size() };
+  }
+
+  // HTML is always decoded, since it is patched
+  bool is_html(const Header& header) {
+    const auto it = header.find("Content-Type");
+    return (it != header.end() &&
+      iequals(split_content_type(it->second).first, "text/html"));
+  }
+
+  bool is_connection_close(const Header& header) {
+    const auto it = header.find("Connection");
+    return (it != header.end() && iequals(it->second, "close"));
+  }
 } // namespace
 
 struct Client::Response::Impl {
@@ -42,14 +171,84 @@ struct Client::Response::Impl {
     std::shared_ptr<HttpClient::Response>,
     std::shared_ptr<HttpsClient::Response>> response;
   std::error_code error;
-  ByteVector data;
+  StatusCode status_code{ };
+  Header header;
+  bool allow_gzip_passthrough{ };
+  ByteView data;
+  ByteVector inflated_data;
+  std::optional<DeflateStream> deflate_stream;
 };
 
 struct Client::Impl {
+  using Clock = std::chrono::steady_clock;
+  using AnyClient = std::variant<
+    std::shared_ptr<HttpClient>,
+    std::shared_ptr<HttpsClient>>;
+
+  struct IdleClient {
+    AnyClient client;
+    Clock::time_point idle_since;
+  };
+
   std::shared_ptr<asio::io_service> io_service;
   std::shared_ptr<asio::io_service::work> default_work;
   std::string proxy_server;
   std::thread thread;
+  std::shared_ptr<TlsSessionCache> tls_session_cache{
+    std::make_shared<TlsSessionCache>() };
+
+  // idle clients keep their keep-alive connection open
+  // they are keyed by scheme://hostname:port
+  size_t max_idle_connections{ };
+  std::chrono::seconds idle_connection_timeout{ };
+  std::mutex idle_clients_mutex;
+  std::map<std::string, std::vector<IdleClient>, std::less<>> idle_clients;
+  std::atomic<size_t> requests{ };
+  std::atomic<size_t> reused_connections{ };
+
+  template<typename T>
+  std::shared_ptr<T> acquire_client(const std::string& origin,
+      const std::string& hostname_port) {
+    ++requests;
+    if (max_idle_connections) {
+      auto lock = std::lock_guard(idle_clients_mutex);
+      if (auto it = idle_clients.find(origin); it != idle_clients.end()) {
+        auto& clients = it->second;
+        remove_expired(clients);
+        // prefer the most recently used connection
+        while (!clients.empty()) {
+          auto client = std::move(clients.back().client);
+          clients.pop_back();
+          if (auto pointer = std::get_if<std::shared_ptr<T>>(&client)) {
+            ++reused_connections;
+            return std::move(*pointer);
+          }
+        }
+      }
+    }
+    if constexpr (std::is_same_v<T, HttpsClient>)
+      return std::make_shared<HttpsClient>(hostname_port, tls_session_cache);
+    else
+      return std::make_shared<HttpClient>(hostname_port);
+  }
+
+  void release_client(const std::string& origin, AnyClient client) {
+    if (!max_idle_connections)
+      return;
+    auto lock = std::lock_guard(idle_clients_mutex);
+    auto& clients = idle_clients[origin];
+    remove_expired(clients);
+    if (clients.size() >= max_idle_connections)
+      clients.erase(clients.begin());
+    clients.push_back({ std::move(client), Clock::now() });
+  }
+
+  void remove_expired(std::vector<IdleClient>& clients) const {
+    const auto expired = Clock::now() - idle_connection_timeout;
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+      [&](const IdleClient& idle) { return idle.idle_since < expired; }),
+      clients.end());
+  }
 };
 
 //-------------------------------------------------------------------------
@@ -57,8 +256,16 @@ struct Client::Impl {
 Client::Response::Response(std::unique_ptr<Impl> impl)
   : m_impl(std::move(impl)) {
 
-  std::visit([&](const auto& response) {
-    set_data(response->content, response->content.size(), response->header);
+  std::visit([&](auto& response) {
+    m_impl->status_code = static_cast<StatusCode>(
+      std::atoi(response->status_code.c_str()));
+    m_impl->header = std::move(response->header);
+    set_data(get_content(*response));
+
+    // keep upstream buffer only when data still references it
+    if (m_impl->data.empty() ||
+        m_impl->data.data() == m_impl->inflated_data.data())
+      response.reset();
   }, m_impl->response);
 }
 
@@ -67,19 +274,11 @@ Client::Response& Client::Response::operator=(Response&&) = default;
 Client::Response::~Response() = default;
 
 StatusCode Client::Response::status_code() const {
-  auto status_code = 0;
-  std::visit([&](const auto& response) {
-    status_code = std::atoi(response->status_code.c_str());
-  }, m_impl->response);
-  return static_cast<StatusCode>(status_code);
+  return m_impl->status_code;
 }
 
 const Header& Client::Response::header() const {
-  auto header = std::add_pointer_t<Header>{ };
-  std::visit([&](const auto& response) {
-    header = &response->header;
-  }, m_impl->response);
-  return *header;
+  return m_impl->header;
 }
 
 std::error_code Client::Response::error() const {
@@ -90,48 +289,48 @@ ByteView Client::Response::data() const {
   return m_impl->data;
 }
 
-void Client::Response::set_data(std::istream& stream, size_t size, Header& header) {
+const std::optional<DeflateStream>& Client::Response::deflate_stream() const {
+  return m_impl->deflate_stream;
+}
+
+void Client::Response::set_data(ByteView content) {
+  auto& header = m_impl->header;
   if (auto it = header.find("content-encoding"); it != header.end()) {
-    if (it->second == "gzip") {
-      auto zstream = zstr::istream(stream);
-      zstream.exceptions(std::ios_base::badbit);
-
-      auto buffer = GrowBuffer();
-      auto uncompressed_size = std::streamsize{ };
-      while (zstream) {
-        if (uncompressed_size == buffer.capacity())
-          buffer.grow();
-        zstream.read(
-          reinterpret_cast<char*>(buffer.data() + uncompressed_size),
-          buffer.capacity() - uncompressed_size);
-        uncompressed_size += zstream.gcount();
-      }
-      m_impl->data = { buffer.data(), buffer.data() + uncompressed_size };
+    if (it->second == "gzip" && m_impl->allow_gzip_passthrough &&
+        !is_html(header) &&
+        (m_impl->deflate_stream = get_gzip_deflate_stream(content))) {
+      // reference encoded content in upstream buffer
+      m_impl->data = content;
+    }
+    else if (it->second == "gzip" &&
+        inflate_gzip(content, m_impl->inflated_data)) {
+      m_impl->data = m_impl->inflated_data;
 
       // remove content-encoding and update content-length
       header.erase(it);
       if (it = header.find("content-length"); it != header.end())
-        it->second = std::to_string(uncompressed_size);
-      return;
+        it->second = std::to_string(m_impl->data.size());
     }
     else {
       m_impl->error = std::make_error_code(std::errc::illegal_byte_sequence);
     }
   }
   else {
-    m_impl->data.resize(size);
-    stream.read(
-      reinterpret_cast<char*>(m_impl->data.data()),
-      static_cast<std::streamsize>(m_impl->data.size()));
+    // reference content in upstream buffer
+    m_impl->data = content;
   }
 }
 
 //-------------------------------------------------------------------------
 
-Client::Client(std::string proxy_server)
+Client::Client(std::string proxy_server, int max_idle_connections,
+    std::chrono::seconds idle_connection_timeout)
   : m_impl(std::make_unique<Impl>()) {
   m_impl->io_service = sole_io_service();
   m_impl->proxy_server = std::move(proxy_server);
+  m_impl->max_idle_connections =
+    static_cast<size_t>(std::max(max_idle_connections, 0));
+  m_impl->idle_connection_timeout = idle_connection_timeout;
 }
 
 Client::Client(Client&&) = default;
@@ -146,11 +345,12 @@ void Client::shutdown() {
 
 void Client::request(std::string_view url, std::string_view method,
     Header header, ByteView data, std::chrono::seconds timeout,
-    HandleResponse handle_response) {
+    bool allow_gzip_passthrough, HandleResponse handle_response) {
 
   const auto scheme = get_scheme(url);
   const auto hostname_port = std::string(get_hostname_port(url));
   const auto path = url.substr(scheme.size() + 3 + hostname_port.size());
+  const auto origin = std::string(scheme) + "://" + hostname_port;
 
   const auto [begin, end] = header.equal_range("accept-encoding");
   header.erase(begin, end);
@@ -162,19 +362,28 @@ void Client::request(std::string_view url, std::string_view method,
     client->config.proxy_server = m_impl->proxy_server;
     client->request(std::string(method), std::string(path),
       as_string_view(data), header,
-      [ client, handle_response = std::move(handle_response)](
+      [ client, origin, impl = m_impl.get(), allow_gzip_passthrough,
+        handle_response = std::move(handle_response)](
           auto response, const std::error_code& error) {
+        if (!error && !is_connection_close(response->header))
+          impl->release_client(origin, client);
+
         auto response_impl = std::make_unique<Response::Impl>();
         response_impl->response = std::move(response);
         response_impl->error = error;
+        response_impl->allow_gzip_passthrough = allow_gzip_passthrough;
         handle_response({ std::move(response_impl) });
       });
   };
 
   if (scheme == "http")
-    request(std::make_shared<HttpClient>(hostname_port));
+    request(m_impl->acquire_client<HttpClient>(origin, hostname_port));
   else if (scheme == "https")
-    request(std::make_shared<HttpsClient>(hostname_port, false));
+    request(m_impl->acquire_client<HttpsClient>(origin, hostname_port));
   else
     throw std::runtime_error("invalid scheme");
 }
+
+auto Client::statistics() const -> Statistics {
+  return { m_impl->requests, m_impl->reused_connections };
+}
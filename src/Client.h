@@ -21,24 +21,34 @@ public:
     StatusCode status_code() const;
     const Header& header() const;
     ByteView data() const;
+    // deflate stream of gzip encoded data, which was passed through
+    const std::optional<DeflateStream>& deflate_stream() const;
 
   private:
-    void set_data(std::istream& stream, size_t size, Header& header);
+    void set_data(ByteView content);
 
     std::unique_ptr<Impl> m_impl;
   };
   using HandleResponse = std::function<void(Response)>;
 
+  struct Statistics {
+    size_t requests;
+    size_t reused_connections;
+  };
+
   static void shutdown();
 
-  explicit Client(std::string proxy_server = "");
+  explicit Client(std::string proxy_server = "",
+    int max_idle_connections = 0,
+    std::chrono::seconds idle_connection_timeout = { });
   Client(Client&&);
   Client& operator=(Client&&);
   ~Client();
 
   void request(std::string_view url, std::string_view method,
     Header header, ByteView data, std::chrono::seconds timeout,
-    HandleResponse handle_response);
+    bool allow_gzip_passthrough, HandleResponse handle_response);
+  Statistics statistics() const;
 
 private:
   struct Impl;
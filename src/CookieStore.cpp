@@ -6,6 +6,7 @@
 
 void CookieStore::set(const std::string& url, std::string_view cookie) {
   auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
   const auto hostname = std::string(get_hostname(url));
   const auto equal = cookie.find('=');
   const auto key = cookie.substr(0, equal);
@@ -16,6 +17,7 @@ void CookieStore::set(const std::string& url, std::string_view cookie) {
 
 std::string CookieStore::serialize() const {
   auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
   auto ss = std::ostringstream();
   for (const auto& [url, cookies] : m_cookies) {
     ss << url << '\r' << '\n';
@@ -28,6 +30,15 @@ std::string CookieStore::serialize() const {
 void CookieStore::deserialize(std::string_view data) {
   auto lock = std::lock_guard(m_mutex);
   m_cookies.clear();
+  m_cookies_list_cache.clear();
+  m_serialized = data;
+}
+
+void CookieStore::parse_serialized() const {
+  if (m_serialized.empty())
+    return;
+  const auto serialized = std::exchange(m_serialized, { });
+  const auto data = std::string_view(serialized);
 
   auto* cookies = std::add_pointer_t<std::map<std::string, std::string>>{ };
   const auto end = data.end();
@@ -57,6 +68,7 @@ void CookieStore::deserialize(std::string_view data) {
 
 std::string CookieStore::get_cookies_list(const std::string& url) const {
   auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
   const auto hostname = std::string(get_hostname(url));
   auto it = m_cookies_list_cache.find(hostname);
   if (it == end(m_cookies_list_cache))
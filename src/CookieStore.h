@@ -13,9 +13,12 @@ public:
   std::string get_cookies_list(const std::string& url) const;
 
 private:
+  void parse_serialized() const;
   std::string build_cookies_list(const std::string& url) const;
 
   mutable std::mutex m_mutex;
-  std::map<std::string, std::map<std::string, std::string>> m_cookies;
+  // deserialized data is only parsed on first use
+  mutable std::string m_serialized;
+  mutable std::map<std::string, std::map<std::string, std::string>> m_cookies;
   mutable std::map<std::string, std::string> m_cookies_list_cache;
 };
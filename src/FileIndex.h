@@ -0,0 +1,149 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// open addressing hash table with filenames stored in a single arena,
+// lookups can be done with a prefix and a filename without concatenating
+template<typename T>
+class FileIndex {
+public:
+  bool empty() const { return m_entries.empty(); }
+  size_t size() const { return m_entries.size(); }
+
+  void clear() {
+    m_filenames.clear();
+    m_entries.clear();
+    m_slots.clear();
+  }
+
+  void reserve(size_t count) {
+    m_entries.reserve(count);
+    if (count * 2 > m_slots.size())
+      rehash(count * 2);
+  }
+
+  // returns false when filename already exists
+  bool insert(std::string_view filename, T value) {
+    return insert(filename, std::move(value), false);
+  }
+
+  // replaces value when filename already exists, keeping its position
+  bool insert_or_assign(std::string_view filename, T value) {
+    return insert(filename, std::move(value), true);
+  }
+
+  const T* find(std::string_view filename) const {
+    return find({ }, filename);
+  }
+
+  const T* find(std::string_view prefix, std::string_view filename) const {
+    if (m_slots.empty())
+      return nullptr;
+    const auto hash = get_hash(prefix, filename);
+    const auto slot = find_slot(hash, prefix, filename);
+    if (m_slots[slot] == empty_slot)
+      return nullptr;
+    return &m_entries[m_slots[slot]].value;
+  }
+
+  bool contains(std::string_view filename) const {
+    return (find(filename) != nullptr);
+  }
+
+  // iterates in insertion order
+  template<typename F>
+  void for_each(F&& callback) const {
+    for (const auto& entry : m_entries)
+      callback(std::string_view(m_filenames).substr(
+        entry.filename_offset, entry.filename_size), entry.value);
+  }
+
+private:
+  static constexpr auto empty_slot = ~uint32_t{ };
+
+  struct StoredEntry {
+    uint32_t filename_offset;
+    uint32_t filename_size;
+    uint64_t hash;
+    T value;
+  };
+
+  bool insert(std::string_view filename, T value, bool assign) {
+    if ((m_entries.size() + 1) * 2 > m_slots.size())
+      rehash(std::max(size_t{ 16 }, m_slots.size() * 2));
+
+    const auto hash = get_hash({ }, filename);
+    auto slot = find_slot(hash, { }, filename);
+    if (m_slots[slot] != empty_slot) {
+      if (assign)
+        m_entries[m_slots[slot]].value = std::move(value);
+      return false;
+    }
+
+    m_slots[slot] = static_cast<uint32_t>(m_entries.size());
+    m_entries.push_back({
+      static_cast<uint32_t>(m_filenames.size()),
+      static_cast<uint32_t>(filename.size()),
+      hash,
+      std::move(value)
+    });
+    m_filenames.append(filename);
+    return true;
+  }
+
+  static uint64_t get_hash(std::string_view prefix, std::string_view filename) {
+    // FNV-1a
+    auto hash = uint64_t{ 14695981039346656037ull };
+    for (auto string : { prefix, filename })
+      for (auto c : string) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+      }
+    return hash;
+  }
+
+  bool equals(const StoredEntry& entry,
+      std::string_view prefix, std::string_view filename) const {
+    if (entry.filename_size != prefix.size() + filename.size())
+      return false;
+    const auto stored = std::string_view(m_filenames).substr(
+      entry.filename_offset, entry.filename_size);
+    return (stored.substr(0, prefix.size()) == prefix &&
+            stored.substr(prefix.size()) == filename);
+  }
+
+  size_t find_slot(uint64_t hash,
+      std::string_view prefix, std::string_view filename) const {
+    const auto mask = m_slots.size() - 1;
+    for (auto slot = static_cast<size_t>(hash) & mask; ; slot = (slot + 1) & mask) {
+      const auto index = m_slots[slot];
+      if (index == empty_slot)
+        return slot;
+      const auto& entry = m_entries[index];
+      if (entry.hash == hash && equals(entry, prefix, filename))
+        return slot;
+    }
+  }
+
+  void rehash(size_t min_slot_count) {
+    auto slot_count = size_t{ 16 };
+    while (slot_count < min_slot_count)
+      slot_count *= 2;
+    m_slots.assign(slot_count, empty_slot);
+    const auto mask = slot_count - 1;
+    for (auto i = size_t{ }; i < m_entries.size(); ++i) {
+      auto slot = static_cast<size_t>(m_entries[i].hash) & mask;
+      while (m_slots[slot] != empty_slot)
+        slot = (slot + 1) & mask;
+      m_slots[slot] = static_cast<uint32_t>(i);
+    }
+  }
+
+  std::string m_filenames;
+  std::vector<StoredEntry> m_entries;
+  std::vector<uint32_t> m_slots;
+};
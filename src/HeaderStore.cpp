@@ -3,23 +3,111 @@
 #include <sstream>
 #include <cstring>
 
+// binary format, all integers are little endian:
+//   magic "WRHS", version, entry count (uint32)
+//   entries sorted by URL:
+//     URL offset, URL size, fields offset (uint32), status code, field count (uint16)
+//   fields of each entry:
+//     name offset, name size, value offset, value size (uint32)
+//   strings
+namespace {
+  const auto binary_magic = std::string_view("WRHS");
+  const auto binary_version = uint32_t{ 1 };
+  const auto binary_header_size = size_t{ 12 };
+  const auto binary_entry_size = size_t{ 16 };
+  const auto binary_field_size = size_t{ 16 };
+
+  void write_uint16(std::string& data, size_t offset, size_t value) {
+    data[offset] = static_cast<char>(value & 0xFF);
+    data[offset + 1] = static_cast<char>((value >> 8) & 0xFF);
+  }
+
+  void write_uint32(std::string& data, size_t offset, size_t value) {
+    write_uint16(data, offset, value & 0xFFFF);
+    write_uint16(data, offset + 2, (value >> 16) & 0xFFFF);
+  }
+
+  size_t read_uint16(std::string_view data, size_t offset) {
+    const auto bytes = reinterpret_cast<const uint8_t*>(data.data() + offset);
+    return static_cast<size_t>(bytes[0] | bytes[1] << 8);
+  }
+
+  size_t read_uint32(std::string_view data, size_t offset) {
+    return read_uint16(data, offset) | read_uint16(data, offset + 2) << 16;
+  }
+} // namespace
+
 void HeaderStore::write(std::string url, StatusCode status_code, Header header) {
+  auto lock = std::lock_guard(m_mutex);
   m_entries[std::move(url)] = { status_code, std::move(header) };
 }
 
 std::string HeaderStore::serialize() const {
-  auto ss = std::ostringstream();
+  auto lock = std::lock_guard(m_mutex);
+  read_binary_entries();
+  auto field_count = size_t{ };
+  auto strings_size = size_t{ };
   for (const auto& [url, entry] : m_entries) {
-    ss << static_cast<int>(entry.status_code) << ' ' << url << '\r' << '\n';
-    for (const auto& [key, value] : entry.header)
-      ss << '\t' << key << ':' << value << '\r' << '\n';
+    field_count += entry.header.size();
+    strings_size += url.size();
+    for (const auto& [name, value] : entry.header)
+      strings_size += name.size() + value.size();
   }
-  return ss.str();
+
+  auto data = std::string(binary_magic);
+  data.resize(binary_header_size +
+    m_entries.size() * binary_entry_size +
+    field_count * binary_field_size);
+  data.reserve(data.size() + strings_size);
+  write_uint32(data, 4, binary_version);
+  write_uint32(data, 8, m_entries.size());
+
+  const auto add_string = [&](size_t offset, std::string_view string) {
+    write_uint32(data, offset, data.size());
+    write_uint32(data, offset + 4, string.size());
+    data.append(string);
+  };
+
+  auto entry_offset = binary_header_size;
+  auto field_offset = entry_offset + m_entries.size() * binary_entry_size;
+  for (const auto& [url, entry] : m_entries) {
+    add_string(entry_offset, url);
+    write_uint32(data, entry_offset + 8, field_offset);
+    write_uint16(data, entry_offset + 12, static_cast<size_t>(entry.status_code));
+    write_uint16(data, entry_offset + 14, entry.header.size());
+    entry_offset += binary_entry_size;
+
+    for (const auto& [name, value] : entry.header) {
+      add_string(field_offset, name);
+      add_string(field_offset + 8, value);
+      field_offset += binary_field_size;
+    }
+  }
+  return data;
 }
 
 void HeaderStore::deserialize(std::string_view data) {
+  auto lock = std::lock_guard(m_mutex);
   m_entries.clear();
+  m_binary.clear();
+  m_binary_count = 0;
+
+  if (data.substr(0, binary_magic.size()) != binary_magic)
+    return deserialize_text(data);
+
+  if (data.size() < binary_header_size ||
+      read_uint32(data, 4) != binary_version)
+    return;
+
+  const auto count = read_uint32(data, 8);
+  if (binary_header_size + count * binary_entry_size > data.size())
+    return;
 
+  m_binary = std::string(data);
+  m_binary_count = count;
+}
+
+void HeaderStore::deserialize_text(std::string_view data) {
   auto* header = std::add_pointer_t<Header>{ };
   const auto end = data.end();
   for (auto it = data.begin(); it != end; it += 2) {
@@ -52,8 +140,83 @@ void HeaderStore::deserialize(std::string_view data) {
 }
 
 auto HeaderStore::read(const std::string& url) const -> const Entry* {
-  const auto it = m_entries.find(url);
-  if (it != m_entries.end())
+  auto lock = std::lock_guard(m_mutex);
+  if (auto it = m_entries.find(url); it != m_entries.end())
     return &it->second;
+
+  // binary search in sorted table
+  auto first = size_t{ };
+  auto count = m_binary_count;
+  while (count > 0) {
+    const auto step = count / 2;
+    if (get_binary_url(first + step) < url) {
+      first += step + 1;
+      count -= step + 1;
+    }
+    else {
+      count = step;
+    }
+  }
+  if (first == m_binary_count || get_binary_url(first) != url)
+    return nullptr;
+
+  if (auto entry = read_binary(first))
+    return &m_entries.emplace(url, std::move(entry.value())).first->second;
   return nullptr;
 }
+
+void HeaderStore::for_each_entry(const std::function<void(
+    const std::string& url, const Entry& entry)>& callback) const {
+  auto lock = std::lock_guard(m_mutex);
+  read_binary_entries();
+  for (const auto& [url, entry] : m_entries)
+    callback(url, entry);
+}
+
+void HeaderStore::read_binary_entries() const {
+  for (auto i = size_t{ }; i < m_binary_count; ++i) {
+    const auto url = get_binary_url(i);
+    if (m_entries.find(url) == m_entries.end())
+      if (auto entry = read_binary(i))
+        m_entries.emplace(url, std::move(entry.value()));
+  }
+}
+
+std::string_view HeaderStore::get_binary_url(size_t index) const {
+  const auto data = std::string_view(m_binary);
+  const auto entry_offset = binary_header_size + index * binary_entry_size;
+  const auto offset = read_uint32(data, entry_offset);
+  const auto size = read_uint32(data, entry_offset + 4);
+  if (offset + size > data.size())
+    return { };
+  return data.substr(offset, size);
+}
+
+auto HeaderStore::read_binary(size_t index) const -> std::optional<Entry> {
+  const auto data = std::string_view(m_binary);
+  const auto entry_offset = binary_header_size + index * binary_entry_size;
+  auto field_offset = read_uint32(data, entry_offset + 8);
+  const auto field_count = read_uint16(data, entry_offset + 14);
+  if (field_offset + field_count * binary_field_size > data.size())
+    return std::nullopt;
+
+  const auto read_string = [&](size_t offset) -> std::optional<std::string> {
+    const auto string_offset = read_uint32(data, offset);
+    const auto string_size = read_uint32(data, offset + 4);
+    if (string_offset + string_size > data.size())
+      return std::nullopt;
+    return std::string(data.substr(string_offset, string_size));
+  };
+
+  auto entry = Entry{ };
+  entry.status_code = static_cast<StatusCode>(read_uint16(data, entry_offset + 12));
+  for (auto i = size_t{ }; i < field_count; ++i) {
+    auto name = read_string(field_offset);
+    auto value = read_string(field_offset + 8);
+    if (!name || !value)
+      return std::nullopt;
+    entry.header.emplace(std::move(name.value()), std::move(value.value()));
+    field_offset += binary_field_size;
+  }
+  return entry;
+}
@@ -2,6 +2,8 @@
 
 #include "common.h"
 #include "libs/SimpleWeb/utility.hpp"
+#include <functional>
+#include <mutex>
 
 using StatusCode = SimpleWeb::StatusCode;
 using Header = SimpleWeb::CaseInsensitiveMultimap;
@@ -16,11 +18,22 @@ public:
   void write(std::string url, StatusCode status_code, Header header);
   std::string serialize() const;
 
+  // accepts binary and text format, binary entries are read on demand
   void deserialize(std::string_view data);
   const Entry* read(const std::string& url) const;
 
-  const std::map<std::string, Entry>& entries() const { return m_entries; }
+  // callback must not access the store
+  void for_each_entry(const std::function<void(
+    const std::string& url, const Entry& entry)>& callback) const;
 
 private:
-  std::map<std::string, Entry> m_entries;
+  void deserialize_text(std::string_view data);
+  std::optional<Entry> read_binary(size_t index) const;
+  void read_binary_entries() const;
+  std::string_view get_binary_url(size_t index) const;
+
+  mutable std::mutex m_mutex;
+  mutable std::map<std::string, Entry, std::less<>> m_entries;
+  std::string m_binary;
+  size_t m_binary_count{ };
 };
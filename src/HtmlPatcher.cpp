@@ -4,28 +4,75 @@
 #include "gumbo.h"
 #include <stack>
 #include <optional>
+#include <algorithm>
+#include <sstream>
+#include <set>
+#include <utility>
 #include <cctype>
-#include <cstring>
+
+namespace {
+  // big documents are only scanned, since building the tree is expensive
+  const auto scan_html_threshold = size_t{ 1 << 20 };
+
+  // entries exceeding the size are not stored in the archive
+  const auto max_serialized_patch_cache_size = size_t{ 4 << 20 };
+
+  size_t get_serialized_size(const std::string& key,
+      const HtmlPatches& patches, const std::string& filename) {
+    // numbers and separators are estimated
+    auto size = key.size() + patches.base_url.size() + filename.size() + 24;
+    for (const auto& patch : patches.patches)
+      size += patch.patch.size() + 24;
+    return size;
+  }
+} // namespace
 
 HtmlPatcher::HtmlPatcher(
       std::string server_base,
       std::string base_url,
-      std::string data,
+      std::string_view data,
       std::string inject_js_path,
       bool patch_base_tag,
       bool patch_title,
       std::string cookies,
-      time_t response_time)
+      time_t response_time,
+      std::shared_ptr<const HtmlPatches> patches,
+      bool collect_subresource_urls)
     : m_server_base(std::move(server_base)),
-      m_data(std::move(data)),
+      m_data(data),
       m_cookies(std::move(cookies)),
       m_inject_js_path(std::move(inject_js_path)),
       m_patch_base_tag(patch_base_tag),
       m_patch_title(patch_title),
-      m_response_time(response_time) {
+      m_collect_subresource_urls(collect_subresource_urls),
+      m_response_time(response_time),
+      m_patches(std::move(patches)) {
+
+  if (m_patches)
+    return;
 
   update_base_url(base_url);
-  parse_html();
+  if (m_data.size() >= scan_html_threshold)
+    scan_html();
+  else
+    parse_html();
+
+  std::sort(m_parsed_patches.begin(), m_parsed_patches.end(),
+    [](const auto &a, const auto &b) { return a.offset < b.offset; });
+
+  // there should not be overlapping ranges, but there are sometimes.
+  // e.g. http://fabiensanglard.net/doom3/index.php (<a href="dmap.php">>>)
+  auto result = HtmlPatches{ };
+  auto pos = size_t{ };
+  for (auto& patch : m_parsed_patches)
+    if (patch.offset >= pos) {
+      pos = patch.offset + patch.size;
+      result.patches.push_back(std::move(patch));
+    }
+  result.base_url = std::move(m_base_url);
+  result.script_offset = m_script_offset;
+  m_parsed_patches.clear();
+  m_patches = std::make_shared<const HtmlPatches>(std::move(result));
 }
 
 void HtmlPatcher::parse_html() {
@@ -81,6 +128,14 @@ void HtmlPatcher::parse_html() {
         break;
     }
 
+    if (m_collect_subresource_urls)
+      collect_subresource_urls(gumbo_normalized_tagname(element.tag),
+        [&](const char* name) -> std::optional<std::string_view> {
+          if (const auto attrib = gumbo_get_attribute(&element.attributes, name))
+            return attrib->value;
+          return std::nullopt;
+        });
+
     for (const auto name : { "integrity", "crossorigin" })
       if (const auto attrib = gumbo_get_attribute(&element.attributes, name))
         if (*attrib->value) {
@@ -89,26 +144,182 @@ void HtmlPatcher::parse_html() {
           remove_region(range({ begin, static_cast<size_t>(end - begin) }));
         }
 
-    for (auto i = 0u; i < element.children.length; ++i) {
-      const auto child = static_cast<const GumboNode*>(element.children.data[i]);
+    // push in reverse, so elements are visited in document order
+    for (auto i = element.children.length; i > 0; --i) {
+      const auto child = static_cast<const GumboNode*>(element.children.data[i - 1]);
       if (child->type == GUMBO_NODE_ELEMENT)
         element_stack.push(child);
     }
   }
   gumbo_destroy_output(&kGumboDefaultOptions, output);
 
+  inject_at_head(start_of_head, has_base_tag);
+}
+
+void HtmlPatcher::scan_html() {
+  // single forward pass over the tags, without building a tree
+  const auto data = m_data;
+  const auto is_space = [](char c) {
+    return std::isspace(static_cast<unsigned char>(c)) != 0;
+  };
+  const auto ifind = [&](std::string_view string, size_t pos) {
+    for (; pos + string.size() <= data.size(); ++pos) {
+      pos = data.find('<', pos);
+      if (pos == std::string_view::npos)
+        break;
+      if (iequals(data.substr(pos, string.size()), string))
+        return pos;
+    }
+    return data.size();
+  };
+  const auto skip_to = [&](std::string_view string, size_t pos) {
+    pos = data.find(string, pos);
+    return (pos == std::string_view::npos ? data.size() : pos + string.size());
+  };
+
+  struct Attribute {
+    std::string_view name;
+    std::string_view original_value;
+    std::string_view value;
+  };
+  auto attributes = std::vector<Attribute>();
+  const auto get_attribute = [&](std::string_view name) -> const Attribute* {
+    for (const auto& attribute : attributes)
+      if (iequals(attribute.name, name))
+        return &attribute;
+    return nullptr;
+  };
+
+  const auto region = [&](std::string_view begin, std::string_view end) {
+    return data.substr(static_cast<size_t>(begin.data() - data.data()),
+      static_cast<size_t>(end.data() + end.size() - begin.data()));
+  };
+
+  auto start_of_head = std::optional<const char*>();
+  auto has_base_tag = false;
+
+  for (auto pos = data.find('<'); pos < data.size(); pos = data.find('<', pos)) {
+    const auto tag_begin = pos++;
+    if (data.substr(tag_begin, 4) == "<!--") {
+      pos = skip_to("-->", tag_begin + 4);
+      continue;
+    }
+    if (pos < data.size() && (data[pos] == '!' || data[pos] == '?' || data[pos] == '/')) {
+      pos = skip_to(">", pos);
+      continue;
+    }
+    if (pos >= data.size() || !std::isalpha(static_cast<unsigned char>(data[pos])))
+      continue;
+
+    const auto name_begin = pos;
+    while (pos < data.size() && !is_space(data[pos]) &&
+           data[pos] != '/' && data[pos] != '>')
+      ++pos;
+    const auto name = data.substr(name_begin, pos - name_begin);
+
+    attributes.clear();
+    for (;;) {
+      while (pos < data.size() && (is_space(data[pos]) || data[pos] == '/'))
+        ++pos;
+      if (pos >= data.size() || data[pos] == '>')
+        break;
+
+      auto attribute = Attribute{ };
+      const auto attribute_begin = pos;
+      while (pos < data.size() && !is_space(data[pos]) &&
+             data[pos] != '=' && data[pos] != '>' && data[pos] != '/')
+        ++pos;
+      attribute.name = data.substr(attribute_begin, pos - attribute_begin);
+      auto value_pos = pos;
+      while (value_pos < data.size() && is_space(data[value_pos]))
+        ++value_pos;
+      if (value_pos < data.size() && data[value_pos] == '=') {
+        pos = value_pos + 1;
+        while (pos < data.size() && is_space(data[pos]))
+          ++pos;
+        const auto value_begin = pos;
+        if (pos < data.size() && (data[pos] == '"' || data[pos] == '\'')) {
+          pos = data.find(data[pos], pos + 1);
+          pos = (pos == std::string_view::npos ? data.size() : pos + 1);
+          attribute.value = data.substr(value_begin + 1,
+            std::max(pos - value_begin, size_t{ 2 }) - 2);
+        }
+        else {
+          while (pos < data.size() && !is_space(data[pos]) && data[pos] != '>')
+            ++pos;
+          attribute.value = data.substr(value_begin, pos - value_begin);
+        }
+        attribute.original_value = data.substr(value_begin, pos - value_begin);
+      }
+      // skip character, which neither starts a name nor a value
+      if (pos == attribute_begin)
+        ++pos;
+      attributes.push_back(attribute);
+    }
+    pos = std::min(pos + 1, data.size());
+    const auto tag_end = pos;
+
+    if (iequals(name, "head")) {
+      if (!start_of_head)
+        start_of_head = data.data() + tag_end;
+    }
+    else if (iequals(name, "base")) {
+      if (const auto attribute = get_attribute("href"))
+        apply_base(attribute->original_value);
+      has_base_tag = true;
+    }
+    else if (iequals(name, "title")) {
+      pos = ifind("</title", tag_end);
+      if (m_patch_title)
+        patch_title(data.substr(tag_end, pos - tag_end));
+    }
+    else if (iequals(name, "meta")) {
+      if (const auto attribute = get_attribute("http-equiv"))
+        if (iequals(attribute->value, "content-security-policy")) {
+          remove_region(data.substr(tag_begin, tag_end - tag_begin));
+          continue;
+        }
+    }
+    else if (iequals_any(name, "script", "style", "textarea", "xmp",
+        "iframe", "noembed", "noframes")) {
+      // skip raw text
+      pos = ifind("</" + std::string(name), tag_end);
+    }
+
+    if (m_collect_subresource_urls)
+      collect_subresource_urls(name,
+        [&](const char* attribute_name) -> std::optional<std::string_view> {
+          // values are not decoded, skip the ones containing character references
+          if (const auto attribute = get_attribute(attribute_name))
+            if (attribute->value.find('&') == std::string_view::npos)
+              return attribute->value;
+          return std::nullopt;
+        });
+
+    for (const auto attribute_name : { "integrity", "crossorigin" })
+      if (const auto attribute = get_attribute(attribute_name))
+        if (!attribute->value.empty())
+          remove_region(region(attribute->name, attribute->original_value));
+  }
+
+  inject_at_head(start_of_head, has_base_tag);
+}
+
+void HtmlPatcher::inject_at_head(std::optional<const char*> start_of_head,
+    bool has_base_tag) {
   if (!start_of_head) {
     // sometimes the HTML is too foobared for gumbo
     // e.g.: https://www.retrogames.cz/play_102-DOS.php
-    auto head = std::strstr(m_data.data(), "<head>");
-    if (!head)
-      head = std::strstr(m_data.data(), "<HEAD>");
-    if (head)
-      start_of_head = head + 6;
+    auto head = m_data.find("<head>");
+    if (head == std::string_view::npos)
+      head = m_data.find("<HEAD>");
+    if (head != std::string_view::npos)
+      start_of_head = m_data.data() + head + 6;
   }
 
   if (start_of_head) {
-    inject_patch_script({ *start_of_head, 0 });
+    if (!m_inject_js_path.empty())
+      m_script_offset = static_cast<size_t>(*start_of_head - m_data.data());
     if (!has_base_tag)
       inject_base({ *start_of_head, 0 });
   }
@@ -150,31 +361,63 @@ void HtmlPatcher::patch_title(std::string_view title) {
     patch(title, std::string(trim(title)) + " [" + std::string(hostname) + "]");
 }
 
-void HtmlPatcher::update_base_url(std::string base_url) {
-  m_base_url = std::move(base_url);
+template<typename GetAttribute>
+void HtmlPatcher::collect_subresource_urls(std::string_view tag,
+    GetAttribute&& get_attribute) {
+  if (iequals(tag, "link")) {
+    const auto rel = get_attribute("rel");
+    if (rel && (icontains(*rel, "stylesheet") || icontains(*rel, "icon") ||
+                icontains(*rel, "preload")))
+      if (const auto href = get_attribute("href"))
+        add_subresource_url(*href);
+  }
+  else if (iequals_any(tag, "script", "img", "source")) {
+    if (const auto src = get_attribute("src"))
+      add_subresource_url(*src);
+
+    // e.g. "a.png 1x, b.png 2x"
+    if (auto srcset = get_attribute("srcset"))
+      while (!srcset->empty()) {
+        const auto end = std::min(srcset->find(','), srcset->size());
+        const auto candidate = trim(srcset->substr(0, end));
+        add_subresource_url(candidate.substr(0,
+          std::min(candidate.find(' '), candidate.size())));
+        srcset->remove_prefix(std::min(end + 1, srcset->size()));
+      }
+  }
 }
 
-void HtmlPatcher::inject_patch_script(std::string_view at) {
-  if (m_inject_js_path.empty())
+void HtmlPatcher::add_subresource_url(std::string_view link) {
+  link = trim(link);
+  if (link.empty())
     return;
+  auto url = to_absolute_url(link, m_base_url);
+  if (starts_with(url, "http://") || starts_with(url, "https://"))
+    m_subresource_urls.push_back(std::move(url));
+}
 
+void HtmlPatcher::update_base_url(std::string base_url) {
+  m_base_url = std::move(base_url);
+}
+
+std::string HtmlPatcher::get_patch_script() const {
   const auto escape_quote = [](auto string) {
     replace_all(string, "'", "\\'");
     return string;
   };
-  auto patch_script =
+  const auto& base_url = m_patches->base_url;
+  return
     "<script type='text/javascript'>"
       "__webrecorder = { "
         "server_base:'" + m_server_base + "', "
-        "origin:'" + std::string(get_scheme_hostname_port(m_base_url)) + "', "
-        "host:'" + std::string(get_hostname_port(m_base_url)) + "', "
-        "hostname:'" + std::string(get_hostname(m_base_url)) + "', "
+        "origin:'" + std::string(get_scheme_hostname_port(base_url)) + "', "
+        "host:'" + std::string(get_hostname_port(base_url)) + "', "
+        "hostname:'" + std::string(get_hostname(base_url)) + "', "
         "cookies:'" + escape_quote(m_cookies) + "', "
         "response_time:" + std::to_string(m_response_time) + ", "
       "}"
     "</script>"
     "<script type='text/javascript' src='" + m_inject_js_path + "'></script>";
-  patch(at, std::move(patch_script));
 }
 
 void HtmlPatcher::remove_region(std::string_view at) {
@@ -182,25 +425,200 @@ void HtmlPatcher::remove_region(std::string_view at) {
 }
 
 void HtmlPatcher::patch(std::string_view at, std::string patch) {
-  m_patches.push_back({ at, std::move(patch) });
+  m_parsed_patches.push_back({
+    static_cast<size_t>(at.data() - m_data.data()),
+    at.size(),
+    std::move(patch)
+  });
 }
 
 std::string HtmlPatcher::get_patched() const {
   auto data = std::string();
-  auto patches = m_patches;
-  auto pos = m_data.data();
-  std::sort(patches.begin(), patches.end(),
-    [](const auto &a, const auto &b) { return a.replace.data() < b.replace.data(); });
-  for (const auto& patch : patches) {
-    // there should not be overlapping ranges, but there are sometimes.
-    // e.g. http://fabiensanglard.net/doom3/index.php (<a href="dmap.php">>>)
-    if (pos > patch.replace.data())
-      continue;
+  write_patched([&](std::string_view chunk) { data.append(chunk); });
+  return data;
+}
+
+void HtmlPatcher::write_patched(
+    const std::function<void(std::string_view)>& write) const {
+  const auto data = m_data;
+  auto pos = size_t{ };
+  auto script_offset = m_patches->script_offset;
+  const auto write_script = [&](size_t offset) {
+    if (script_offset.has_value() && script_offset.value() <= offset) {
+      write(data.substr(pos, script_offset.value() - pos));
+      write(get_patch_script());
+      pos = script_offset.value();
+      script_offset.reset();
+    }
+  };
+  for (const auto& patch : m_patches->patches) {
+    if (patch.offset + patch.size > data.size())
+      break;
+    write_script(patch.offset);
+    write(data.substr(pos, patch.offset - pos));
+    write(patch.patch);
+    pos = patch.offset + patch.size;
+  }
+  write_script(data.size());
+  write(data.substr(pos));
+}
+
+//-------------------------------------------------------------------------
+
+std::string HtmlPatchCache::get_key(ByteView data, std::string_view context) {
+  return get_hash(data) + get_hash(as_byte_view(context));
+}
 
-    data.append(pos, patch.replace.data());
-    data.append(patch.patch);
-    pos = patch.replace.data() + patch.replace.size();
+std::shared_ptr<const HtmlPatches> HtmlPatchCache::get(const std::string& key) const {
+  auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
+  const auto it = m_entries.find(key);
+  if (it == m_entries.end())
+    return nullptr;
+  if (!std::exchange(it->second.used, true))
+    m_unused_size -= it->second.size;
+  return it->second.patches;
+}
+
+void HtmlPatchCache::set(std::string key, std::shared_ptr<const HtmlPatches> patches,
+    std::string filename) {
+  auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
+  const auto size = get_serialized_size(key, *patches, filename);
+  insert(std::move(key), { std::move(patches), std::move(filename), true, size });
+}
+
+// m_mutex has to be locked
+void HtmlPatchCache::insert(std::string key, Entry entry) const {
+  if (const auto it = m_entries.find(key); it != m_entries.end()) {
+    m_size -= it->second.size;
+    if (!it->second.used)
+      m_unused_size -= it->second.size;
+    m_entries.erase(it);
   }
-  data.append(pos, m_data.data() + m_data.size());
-  return data;
+
+  // make room by evicting entries, which were not used in this session
+  const auto fits = [&](size_t size) {
+    return (size + entry.size <= max_serialized_patch_cache_size);
+  };
+  if (!fits(m_size) && fits(m_size - m_unused_size)) {
+    for (auto it = m_entries.begin(); !fits(m_size); ) {
+      if (!it->second.used) {
+        m_size -= it->second.size;
+        m_unused_size -= it->second.size;
+        it = m_entries.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  // entries beyond the size would not be stored anyway
+  if (!fits(m_size))
+    return;
+  m_size += entry.size;
+  if (!entry.used)
+    m_unused_size += entry.size;
+  m_entries.emplace(std::move(key), std::move(entry));
+}
+
+std::string HtmlPatchCache::serialize(const IsArchived& is_archived) const {
+  auto lock = std::lock_guard(m_mutex);
+  parse_serialized();
+
+  // entries of unused documents are superseded by used ones
+  auto used_filenames = std::set<std::string_view>();
+  for (const auto& [key, entry] : m_entries)
+    if (entry.used)
+      used_filenames.insert(entry.filename);
+  const auto keep = [&](const Entry& entry, bool used) {
+    if (used)
+      return entry.used;
+    return (!entry.used && is_archived && !entry.filename.empty() &&
+      !used_filenames.count(entry.filename) && is_archived(entry.filename));
+  };
+
+  // patches are prefixed with their size, since they can contain newlines
+  auto ss = std::ostringstream();
+  for (auto used : { true, false })
+    for (const auto& [key, entry] : m_entries) {
+      if (!keep(entry, used))
+        continue;
+      if (static_cast<size_t>(ss.tellp()) > max_serialized_patch_cache_size)
+        break;
+      const auto& patches = *entry.patches;
+      ss << key << ' ' << (patches.script_offset.has_value() ?
+        std::to_string(patches.script_offset.value()) : "-") << ' ' <<
+        patches.base_url << '\t' << entry.filename << '\r' << '\n';
+      for (const auto& patch : patches.patches)
+        ss << '\t' << patch.offset << ' ' << patch.size << ' ' <<
+          patch.patch.size() << ':' << patch.patch << '\r' << '\n';
+    }
+  return ss.str();
+}
+
+void HtmlPatchCache::deserialize(std::string_view data) {
+  auto lock = std::lock_guard(m_mutex);
+  m_entries.clear();
+  m_size = m_unused_size = 0;
+  m_serialized = data;
+}
+
+void HtmlPatchCache::parse_serialized() const {
+  if (m_serialized.empty())
+    return;
+  const auto data = std::exchange(m_serialized, { });
+
+  auto key = std::string();
+  auto filename = std::string();
+  auto patches = std::optional<HtmlPatches>();
+  const auto flush = [&]() {
+    if (patches) {
+      const auto size = get_serialized_size(key, *patches, filename);
+      insert(std::move(key), {
+        std::make_shared<const HtmlPatches>(
+          std::exchange(patches, std::nullopt).value()),
+        std::move(filename), false, size });
+    }
+  };
+
+  auto ss = std::istringstream(data);
+  for (auto c = ss.peek(); c != std::char_traits<char>::eof(); c = ss.peek()) {
+    if (c == '\t' && patches) {
+      auto patch = HtmlPatches::Patch{ };
+      auto patch_size = size_t{ };
+      ss.get();
+      ss >> patch.offset >> patch.size >> patch_size;
+      if (!ss || ss.get() != ':' || patch_size > data.size()) {
+        patches.reset();
+        break;
+      }
+      patch.patch.resize(patch_size);
+      ss.read(patch.patch.data(), static_cast<std::streamsize>(patch_size));
+      patches->patches.push_back(std::move(patch));
+      ss.get();
+    }
+    else {
+      flush();
+      auto script_offset = std::string();
+      patches.emplace();
+      ss >> key >> script_offset;
+      ss.get();
+      if (script_offset != "-")
+        patches->script_offset = std::strtoull(script_offset.c_str(), nullptr, 10);
+      std::getline(ss, patches->base_url, '\r');
+      // filename of document follows the base URL
+      filename.clear();
+      if (const auto tab = patches->base_url.find('\t'); tab != std::string::npos) {
+        filename = patches->base_url.substr(tab + 1);
+        patches->base_url.resize(tab);
+      }
+    }
+    if (!ss || ss.get() != '\n') {
+      patches.reset();
+      break;
+    }
+  }
+  flush();
 }
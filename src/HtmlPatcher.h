@@ -1,44 +1,110 @@
 #pragma once
 
 #include "common.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 
+// patches which only depend on the document, its URL and the settings
+struct HtmlPatches {
+  struct Patch {
+    size_t offset;
+    size_t size;
+    std::string patch;
+  };
+
+  // sorted and not overlapping
+  std::vector<Patch> patches;
+  std::string base_url;
+  std::optional<size_t> script_offset;
+};
+
+// data is not copied and has to outlive the patcher
 class HtmlPatcher final {
 public:
   HtmlPatcher(std::string server_base,
     std::string base_url,
-    std::string data,
+    std::string_view data,
     std::string inject_js_path,
     bool patch_base_tag,
     bool patch_title,
     std::string cookies,
-    time_t response_time);
+    time_t response_time,
+    std::shared_ptr<const HtmlPatches> patches = nullptr,
+    bool collect_subresource_urls = false);
 
   std::string get_patched() const;
+  // emits patched document in consecutive chunks
+  void write_patched(const std::function<void(std::string_view)>& write) const;
+  const std::shared_ptr<const HtmlPatches>& patches() const { return m_patches; }
+  // absolute URLs of linked scripts, stylesheets, icons and images
+  const std::vector<std::string>& subresource_urls() const { return m_subresource_urls; }
 
 private:
   void update_base_url(std::string url);
   void parse_html();
+  void scan_html();
+  void inject_at_head(std::optional<const char*> start_of_head, bool has_base_tag);
   std::string_view get_link(std::string_view at) const;
   void inject_base(std::string_view at);
   void apply_base(std::string_view at);
   void patch_title(std::string_view title);
-  void inject_patch_script(std::string_view at);
+  template<typename GetAttribute>
+  void collect_subresource_urls(std::string_view tag, GetAttribute&& get_attribute);
+  void add_subresource_url(std::string_view link);
+  std::string get_patch_script() const;
   void remove_region(std::string_view at);
   void patch(std::string_view at, std::string patch);
 
-  struct Patch {
-    std::string_view replace;
-    std::string patch;
-  };
-
   const std::string m_server_base;
   const std::string m_mime_type;
-  const std::string m_data;
+  const std::string_view m_data;
   const std::string m_cookies;
   const std::string m_inject_js_path;
   const bool m_patch_base_tag;
   const bool m_patch_title;
+  const bool m_collect_subresource_urls;
   const time_t m_response_time;
   std::string m_base_url;
-  std::vector<Patch> m_patches;
+  std::vector<HtmlPatches::Patch> m_parsed_patches;
+  std::optional<size_t> m_script_offset;
+  std::shared_ptr<const HtmlPatches> m_patches;
+  std::vector<std::string> m_subresource_urls;
+};
+
+// threadsafe cache of patches, which can be stored in the archive,
+// its size is bounded by the size which is stored
+class HtmlPatchCache final {
+public:
+  using IsArchived = std::function<bool(const std::string& filename)>;
+
+  static std::string get_key(ByteView data, std::string_view context);
+
+  std::shared_ptr<const HtmlPatches> get(const std::string& key) const;
+  void set(std::string key, std::shared_ptr<const HtmlPatches> patches,
+    std::string filename);
+  // keeps entries which were used, or whose documents are still archived
+  std::string serialize(const IsArchived& is_archived = { }) const;
+  void deserialize(std::string_view data);
+
+private:
+  struct Entry {
+    std::shared_ptr<const HtmlPatches> patches;
+    std::string filename;
+    bool used;
+    size_t size;
+  };
+
+  void parse_serialized() const;
+  void insert(std::string key, Entry entry) const;
+
+  mutable std::mutex m_mutex;
+  // deserialized data is only parsed on first use
+  mutable std::string m_serialized;
+  mutable std::map<std::string, Entry> m_entries;
+  // estimated serialized size of all entries and of the unused ones
+  mutable size_t m_size{ };
+  mutable size_t m_unused_size{ };
 };
@@ -5,6 +5,9 @@
 #include "LossyCompressor.h"
 #include "platform.h"
 #include <sstream>
+#include <set>
+#include <atomic>
+#include <ctime>
 #include <utility>
 #include <cassert>
 
@@ -14,11 +17,58 @@ namespace {
   const auto shutdown_request = "/__webrecorder_exit";
   const auto inject_javascript_request = "/__webrecorder.js";
   const auto first_overlay_path = "first/";
+  const auto compute_pool_min_file_size = uint64_t{ 64 * 1024 };
+  const auto max_concurrent_prefetches = 6;
+
+  // reports progress once a second, and completion when it was reported
+  std::function<void(bool)> get_progress_callback(size_t total, const char* what) {
+    const auto start = std::time(nullptr);
+    auto copied = std::make_shared<std::atomic<size_t>>();
+    auto last_report = std::make_shared<std::atomic<time_t>>(start);
+    return [total, what, copied, start, last_report](bool) {
+      const auto count = ++*copied;
+      const auto now = std::time(nullptr);
+      auto last = last_report->load();
+      if ((now > last && last_report->compare_exchange_strong(last, now)) ||
+          (count == total && last != start))
+        log(Event::info, what, " ", static_cast<int>(count * 100 / total),
+          "% of ", static_cast<int>(total), " files");
+    };
+  }
+
+  // copies compressed data as it is, only inflates when it is not mapped
+  // or stored files should be compressed
+  void copy_archived_file(const ArchiveReader& reader, ArchiveWriter& writer,
+      const std::string& filename, ArchiveReader::FileVersion version,
+      const std::string& target_filename, bool compress_stored,
+      std::function<void(bool)> on_complete) {
+    const auto info = reader.get_file_info(filename, version);
+    if (!info)
+      return on_complete(false);
+
+    if (!compress_stored || info->compression_method != 0)
+      if (auto data = reader.read_raw(filename, version); !data.empty())
+        return writer.async_write_raw(target_filename, data,
+          info->compression_method, info->crc32, info->uncompressed_size,
+          info->modification_time, std::move(on_complete));
+
+    auto buffer = ByteVector();
+    if (auto data = reader.read(filename, buffer, version); !data.empty())
+      return writer.async_write(target_filename, data,
+        info->modification_time, false,
+        [buffer = std::move(buffer), on_complete](bool succeeded) {
+          on_complete(succeeded);
+        });
+
+    on_complete(false);
+  }
 } // namespace
 
 Logic::Logic(Settings* settings)
   : m_settings(*settings),
-    m_client(m_settings.proxy_server) {
+    m_client(m_settings.proxy_server,
+      m_settings.max_idle_connections,
+      m_settings.idle_connection_timeout) {
   initialize();
 }
 
@@ -34,6 +84,8 @@ void Logic::initialize() {
 
   if (!m_settings.input_file.empty()) {
     auto archive_reader = std::make_unique<ArchiveReader>();
+    archive_reader->set_context_count(static_cast<size_t>(
+      get_max_thread_count(m_settings)));
     if (archive_reader->open(m_settings.input_file))
       m_archive_reader = std::move(archive_reader);
   }
@@ -52,8 +104,17 @@ void Logic::initialize() {
     if (auto data = m_archive_reader->read("cookies"); !data.empty())
       m_cookie_store.deserialize(as_string_view(data));
 
+    if (auto data = m_archive_reader->read("patches"); !data.empty())
+      m_html_patch_cache.deserialize(as_string_view(data));
+
     if (m_settings.serve_policy == ServePolicy::first_archived)
       m_archive_reader->set_overlay_path(first_overlay_path);
+
+    if (m_settings.response_cache_size_mb > 0)
+      m_response_cache = std::make_unique<ResponseCache>(
+        static_cast<size_t>(m_settings.response_cache_size_mb) << 20);
+
+    m_compute_pool = std::make_unique<ThreadPool>();
   }
   if (m_uid.empty())
     m_uid = generate_id();
@@ -64,19 +125,41 @@ void Logic::initialize() {
 
   if (!m_settings.output_file.empty()) {
     m_archive_writer = std::make_unique<ArchiveWriter>();
-    for (auto i = 0; i < 5; ++i)
-      if (m_archive_writer->open(generate_temporary_filename("webrecorder-")))
-        break;
-    if (!m_archive_writer->is_open())
-      throw std::runtime_error("opening temporary file failed");
 
-    m_archive_writer->move_on_close(m_settings.output_file, true);
-    m_archive_writer->write("uid", as_byte_view(m_uid));
-    m_archive_writer->write("url", as_byte_view(m_settings.url));
+    // append to input file instead of rewriting it, when only latest version is kept
+    if (m_settings.append && m_archive_reader &&
+        m_settings.archive_policy == ArchivePolicy::latest &&
+        m_settings.input_file == m_settings.output_file) {
+      m_append_to_input = m_archive_writer->open(m_settings.output_file, true,
+        { "headers", "cookies", "patches" });
+      if (!m_append_to_input)
+        log(Event::info, "appending to archive failed, rewriting it");
+    }
+
+    if (m_append_to_input) {
+      if (as_string_view(m_archive_reader->read("url")) != m_settings.url)
+        m_archive_writer->write("url", as_byte_view(m_settings.url));
+    }
+    else {
+      for (auto i = 0; i < 5; ++i)
+        if (m_archive_writer->open(generate_temporary_filename("webrecorder-")))
+          break;
+      if (!m_archive_writer->is_open())
+        throw std::runtime_error("opening temporary file failed");
+
+      m_archive_writer->move_on_close(m_settings.output_file, true);
+      m_archive_writer->write("uid", as_byte_view(m_uid));
+      m_archive_writer->write("url", as_byte_view(m_settings.url));
+    }
 
     if (m_settings.allow_lossy_compression)
       m_archive_writer->set_lossy_compressor(
         std::make_unique<LossyCompressor>());
+    m_archive_writer->set_compression_level(m_settings.compression_level);
+    m_archive_writer->set_deduplicate(m_settings.deduplicate);
+
+    m_prefetch = (m_settings.prefetch &&
+      m_settings.download_policy != DownloadPolicy::never);
   }
 
   if (m_settings.url.empty())
@@ -96,15 +179,29 @@ void Logic::initialize() {
 }
 
 void Logic::finish() {
+  // wait for pending responses
+  m_compute_pool.reset();
+
   append_unrequested_files();
 
-  m_archive_reader.reset();
+  if (m_settings.verbose) {
+    const auto statistics = m_client.statistics();
+    log(Event::info, "reused connections for ", statistics.reused_connections,
+      " of ", statistics.requests, " requests");
+  }
 
   if (m_archive_writer) {
     m_archive_writer->write("headers", as_byte_view(m_header_writer.serialize()));
     m_archive_writer->write("cookies", as_byte_view(m_cookie_store.serialize()));
-    m_archive_writer.reset();
+    m_archive_writer->write("patches", as_byte_view(m_html_patch_cache.serialize(
+      [&](const std::string& filename) { return m_archive_writer->contains(filename); })));
+
+    // pending writes can reference the mapped input file
+    m_archive_writer->flush();
   }
+
+  m_archive_reader.reset();
+  m_archive_writer.reset();
 }
 
 void Logic::set_local_server_url(std::string local_server_url) {
@@ -207,6 +304,17 @@ void Logic::handle_file_request(Server::Request request, const std::string& url)
   const auto expired = (!cache_info.has_value() || cache_info->expired);
 
   const auto action = get_file_request_action(m_settings, archived, expired);
+
+  // inflate and patch big files on compute pool, so I/O threads stay responsive
+  if (action.serve && !action.download && is_expensive_to_serve(identifying_url))
+    return m_compute_pool->post([this, url, write = action.write,
+        request = std::make_shared<Server::Request>(std::move(request))]() {
+      if (!serve_from_archive(*request, url, write))
+        log(Event::error);
+      if (!request->response_sent())
+        serve_error(*request, url, StatusCode::server_error_service_unavailable);
+    });
+
   if (action.serve && !serve_from_archive(request, url, action.write))
     log(Event::error);
 
@@ -218,9 +326,34 @@ void Logic::handle_file_request(Server::Request request, const std::string& url)
   forward_request(std::move(request), url, cache_info);
 }
 
+bool Logic::is_expensive_to_serve(const std::string& identifying_url) {
+  // initial requests are handled while single threaded
+  if (!m_compute_pool || m_start_threads_callback || !m_archive_reader)
+    return false;
+
+  if (m_response_cache && m_response_cache->get(identifying_url))
+    return false;
+
+  const auto info = m_archive_reader->get_file_info(
+    to_local_filename(identifying_url));
+  return (info && info->uncompressed_size >= compute_pool_min_file_size);
+}
+
 void Logic::forward_request(Server::Request request, const std::string& url,
     const std::optional<CacheInfo>& cache_info) {
 
+  // pass through gzip encoded responses, when the browser accepts them
+  const auto accepts_gzip = [&]() {
+    const auto it = request.header().find("Accept-Encoding");
+    return (it != request.header().end() && icontains(it->second, "gzip"));
+  }();
+
+  // wait for identical download in progress
+  const auto identifying_url = get_identifying_url(url, request.data());
+  auto download_id = uint64_t{ };
+  if (coalesce_download(identifying_url, request, accepts_gzip, download_id))
+    return log(Event::download_coalesced, url);
+
   log(Event::download_started, url);
 
   auto header = Header();
@@ -246,35 +379,130 @@ void Logic::forward_request(Server::Request request, const std::string& url,
   const auto& method = request.method();
   const auto& timeout = (cache_info ?
     m_settings.refresh_timeout : m_settings.request_timeout);
-  m_client.request(url, method, std::move(header), data, timeout,
-    [ this, url,
-      request = std::make_shared<Server::Request>(std::move(request))
-    ](Client::Response response) {
-      handle_response(*request, url, std::move(response));
-    });
+  const auto shared_request = std::make_shared<Server::Request>(std::move(request));
+  try {
+    m_client.request(url, method, std::move(header), data, timeout, accepts_gzip,
+      [this, url, download_id, request = shared_request](Client::Response response) {
+        handle_response(request, url, download_id, std::move(response));
+      });
+  }
+  catch (...) {
+    // do not leave coalesced requests waiting
+    for (const auto& other : take_coalesced_requests(identifying_url, download_id))
+      serve_error(*other, url, StatusCode::server_error_service_unavailable);
+    if (!shared_request->response_sent())
+      serve_error(*shared_request, url, StatusCode::server_error_service_unavailable);
+    throw;
+  }
 }
 
-void Logic::handle_response(Server::Request& request,
-    const std::string& url, Client::Response response) {
+bool Logic::coalesce_download(const std::string& identifying_url,
+    Server::Request& request, bool accepts_gzip, uint64_t& download_id) {
+  // only requests without side effects, which get the complete file
+  if (request.method() != "GET")
+    return false;
+  for (const auto& [name, value] : request.header())
+    if (iequals(name, "Range") ||
+        iequals(std::string_view(name).substr(0, 3), "If-"))
+      return false;
+
+  auto lock = std::lock_guard(m_write_mutex);
+  auto it = m_pending_downloads.find(identifying_url);
+  if (it == m_pending_downloads.end()) {
+    download_id = ++m_next_download_id;
+    m_pending_downloads.emplace(identifying_url,
+      PendingDownload{ download_id, accepts_gzip, { } });
+    return false;
+  }
+  // response may be gzip encoded
+  if (it->second.gzip_passthrough && !accepts_gzip)
+    return false;
+  it->second.requests.push_back(
+    std::make_shared<Server::Request>(std::move(request)));
+  return true;
+}
+
+std::vector<std::shared_ptr<Server::Request>> Logic::take_coalesced_requests(
+    const std::string& identifying_url, uint64_t download_id) {
+  auto lock = std::lock_guard(m_write_mutex);
+  auto it = m_pending_downloads.find(identifying_url);
+  if (it == m_pending_downloads.end() || !download_id ||
+      it->second.download_id != download_id)
+    return { };
+  auto requests = std::move(it->second.requests);
+  m_pending_downloads.erase(it);
+  return requests;
+}
+
+// request is null when response was prefetched
+void Logic::handle_response(std::shared_ptr<Server::Request> request,
+    const std::string& url, uint64_t download_id, Client::Response response) {
+
+  const auto identifying_url = get_identifying_url(url,
+    (request ? request->data() : ByteView()));
+  const auto coalesced = take_coalesced_requests(identifying_url, download_id);
 
   const auto status_code = response.status_code();
   if (!is_success(status_code) && !is_redirect(status_code))
-    if (serve_from_archive(request, url, true))
+    if (request && serve_from_archive(*request, url, true)) {
+      for (const auto& other : coalesced)
+        if (!serve_from_archive(*other, url, false))
+          serve_error(*other, url, status_code);
       return log(Event::download_omitted, url);
+    }
+
+  if (response.error()) {
+    for (const auto& other : coalesced)
+      serve_error(*other, url, status_code);
+    if (request)
+      serve_error(*request, url, status_code);
+    return;
+  }
+
+  // patch big HTML documents on compute pool, so I/O threads stay responsive
+  if ((request || !coalesced.empty()) && is_expensive_to_patch(response))
+    return m_compute_pool->post([this, request, url, identifying_url, coalesced,
+        response = std::make_shared<Client::Response>(std::move(response))]() {
+      serve_downloaded(request.get(), url, identifying_url, coalesced,
+        std::move(*response));
+    });
+
+  serve_downloaded(request.get(), url, identifying_url, coalesced,
+    std::move(response));
+}
 
-  if (response.error())
-    return serve_error(request, url, status_code);
+bool Logic::is_expensive_to_patch(const Client::Response& response) {
+  // initial requests are handled while single threaded
+  if (!m_compute_pool || m_start_threads_callback ||
+      response.data().size() < compute_pool_min_file_size)
+    return false;
+
+  const auto it = response.header().find("Content-Type");
+  return (it != response.header().end() &&
+    iequals(split_content_type(it->second).first, "text/html"));
+}
+
+void Logic::serve_downloaded(Server::Request* request, const std::string& url,
+    const std::string& identifying_url,
+    const std::vector<std::shared_ptr<Server::Request>>& coalesced,
+    Client::Response response) {
 
+  const auto status_code = response.status_code();
   log(Event::download_finished, status_code, " ", response.data().size(), " ", url);
   const auto response_time = std::time(nullptr);
 
-  serve_file(request, url, status_code,
-    response.header(), response.data(), response_time);
+  if (request)
+    serve_file(*request, url, status_code,
+      response.header(), response.data(), response_time);
+  for (const auto& other : coalesced)
+    serve_file(*other, url, status_code,
+      response.header(), response.data(), response_time);
 
   const auto& header = response.header();
   const auto& data = response.data();
-  async_write_file(get_identifying_url(url, request.data()),
-    status_code, header, data, response_time, true,
+  const auto& deflated = response.deflate_stream();
+  async_write_file(identifying_url,
+    status_code, header, data, deflated, response_time, true,
     [response = std::make_shared<Client::Response>(std::move(response))
     ](bool succeeded) {
       if (!succeeded)
@@ -282,6 +510,73 @@ void Logic::handle_response(Server::Request& request,
     });
 }
 
+void Logic::prefetch(const std::vector<std::string>& urls) {
+  for (auto url : urls) {
+    if (get_scheme(url) == "http")
+      url = apply_strict_transport_security(std::move(url));
+    if (m_blocked_hosts && m_blocked_hosts->contains(url))
+      continue;
+
+    // only files which are not archived yet
+    const auto identifying_url = get_identifying_url(url, { });
+    if (m_header_reader.read(identifying_url))
+      continue;
+
+    auto lock = std::lock_guard(m_write_mutex);
+    if (m_archive_writer->contains(to_local_filename(identifying_url)) ||
+        m_pending_downloads.count(identifying_url))
+      continue;
+
+    // requests of browser wait for prefetched response
+    const auto download_id = ++m_next_download_id;
+    m_pending_downloads.emplace(identifying_url,
+      PendingDownload{ download_id, false, { } });
+    m_prefetch_queue.emplace_back(std::move(url), download_id);
+  }
+  start_prefetches();
+}
+
+void Logic::start_prefetches() {
+  auto lock = std::unique_lock(m_write_mutex);
+  auto prefetches = std::vector<std::pair<std::string, uint64_t>>();
+  for (; m_prefetches_running < max_concurrent_prefetches &&
+         !m_prefetch_queue.empty(); ++m_prefetches_running) {
+    prefetches.push_back(std::move(m_prefetch_queue.front()));
+    m_prefetch_queue.pop_front();
+  }
+  lock.unlock();
+
+  for (const auto& [url, download_id] : prefetches) {
+    log(Event::download_started, url);
+
+    auto header = Header();
+    header.emplace("Referer", get_scheme_hostname_port(url));
+    if (auto cookies = m_cookie_store.get_cookies_list(url); !cookies.empty())
+      header.emplace("Cookie", cookies);
+
+    try {
+      m_client.request(url, "GET", std::move(header), { },
+        m_settings.request_timeout, false,
+        [this, url = url, download_id = download_id](Client::Response response) {
+          handle_response(nullptr, url, download_id, std::move(response));
+
+          auto lock = std::unique_lock(m_write_mutex);
+          --m_prefetches_running;
+          lock.unlock();
+          start_prefetches();
+        });
+    }
+    catch (const std::exception& ex) {
+      log(Event::error, ex.what());
+      for (const auto& other : take_coalesced_requests(
+            get_identifying_url(url, { }), download_id))
+        serve_error(*other, url, StatusCode::server_error_service_unavailable);
+      auto lock = std::lock_guard(m_write_mutex);
+      --m_prefetches_running;
+    }
+  }
+}
+
 void Logic::handle_error(Server::Request, std::error_code error) {
   if (const auto message = get_message_utf8(error); !message.empty())
     log(Event::error, message);
@@ -314,18 +609,49 @@ bool Logic::serve_from_archive(Server::Request& request,
   if (!entry)
     return false;
 
+  const auto cached_response = get_cached_response(identifying_url, url);
+  if (cached_response && !request.response_sent()) {
+    handle_initial_redirects(url, entry->status_code, entry->header);
+    if (cached_response->strict_transport_security.has_value())
+      set_strict_transport_security(url,
+        cached_response->strict_transport_security.value());
+    send_prepared_response(request, url, *cached_response);
+  }
+  if (cached_response && !write_to_archive)
+    return true;
+
   const auto filename = to_local_filename(identifying_url);
   const auto info = m_archive_reader->get_file_info(filename);
   const auto response_time = (info.has_value() ? info->modification_time : std::time(nullptr));
-  auto data = m_archive_reader->read(filename);
-  serve_file(request, url, entry->status_code, entry->header, data, response_time);
+  auto buffer = ByteVector();
+  const auto data = m_archive_reader->read(filename, buffer);
+
+  if (!request.response_sent()) {
+    // only cache once initial redirects were handled
+    const auto cache_response = (m_response_cache && !m_start_threads_callback &&
+      entry->header.find("Set-Cookie") == entry->header.end());
+
+    handle_initial_redirects(url, entry->status_code, entry->header);
+    const auto response = prepare_response(url, entry->status_code,
+      entry->header, data, response_time);
+    send_prepared_response(request, url, *response);
+
+    if (cache_response) {
+      // cached response has to own its data
+      if (response->data.data() != as_byte_view(response->buffer).data()) {
+        response->buffer = std::string(as_string_view(response->data));
+        response->data = as_byte_view(response->buffer);
+      }
+      m_response_cache->put(identifying_url, response);
+    }
+  }
 
-  if (write_to_archive) {
-    auto data_view = ByteView(data);
+  // file is kept when appending to input
+  if (write_to_archive && !m_append_to_input) {
     async_write_file(identifying_url,
       entry->status_code, entry->header,
-      data_view, response_time, false,
-      [data = std::move(data)](bool succeeded) {
+      data, std::nullopt, response_time, false,
+      [buffer = std::move(buffer)](bool succeeded) {
         if (!succeeded)
           log(Event::writing_failed);
       });
@@ -333,6 +659,17 @@ bool Logic::serve_from_archive(Server::Request& request,
   return true;
 }
 
+std::shared_ptr<const PreparedResponse> Logic::get_cached_response(
+    const std::string& identifying_url, const std::string& url) {
+  if (!m_response_cache)
+    return nullptr;
+  auto response = m_response_cache->get(identifying_url);
+  if (response && response->cookies.has_value() &&
+      response->cookies.value() != m_cookie_store.get_cookies_list(url))
+    return nullptr;
+  return response;
+}
+
 void Logic::serve_file(Server::Request& request, const std::string& url,
     const StatusCode status_code, const Header& header, ByteView data,
     time_t response_time) {
@@ -342,6 +679,19 @@ void Logic::serve_file(Server::Request& request, const std::string& url,
 
   handle_initial_redirects(url, status_code, header);
 
+  const auto response = prepare_response(url, status_code,
+    header, data, response_time);
+  send_prepared_response(request, url, *response);
+}
+
+std::shared_ptr<PreparedResponse> Logic::prepare_response(const std::string& url,
+    StatusCode status_code, const Header& header, ByteView data,
+    time_t response_time) {
+
+  auto response = std::make_shared<PreparedResponse>();
+  response->status_code = status_code;
+  response->data = data;
+
   auto content_type = std::string();
   if (auto it = header.find("Content-Type"); it != header.end())
     content_type = it->second;
@@ -352,25 +702,46 @@ void Logic::serve_file(Server::Request& request, const std::string& url,
   for (auto it = cookie_begin; it != cookie_end; ++it)
     m_cookie_store.set(url, it->second);
 
-  auto patched_data = std::optional<std::string>();
   if (!data.empty() && iequals_any(mime_type, "text/html")) {
+    // patches only need to be parsed once per document and context
+    const auto inject_js_path = (m_inject_javascript_code.empty() ?
+      "" : inject_javascript_request);
+    const auto patches_key = HtmlPatchCache::get_key(data, 
+      url + ' ' + m_server_base + ' ' + std::string(charset) + ' ' + 
+      inject_js_path + ' ' + (m_settings.patch_base_tag ? '1' : '0') +
+      (m_settings.patch_title ? '1' : '0'));
+    auto patches = m_html_patch_cache.get(patches_key);
+
+    // skip conversion, when data is already UTF-8 or ASCII
+    const auto convert = !is_utf8_compatible(data, charset);
+    const auto converted = (convert ?
+      convert_charset(data, charset, "utf-8") : std::string());
+
+    response->cookies = m_cookie_store.get_cookies_list(url);
     const auto patcher = HtmlPatcher(
       m_server_base, url,
-      convert_charset(data, (charset.empty() ? "utf-8" : charset), "utf-8"),
-      (m_inject_javascript_code.empty() ? "" : inject_javascript_request),
+      (convert ? std::string_view(converted) : as_string_view(data)),
+      inject_js_path,
       m_settings.patch_base_tag,
       m_settings.patch_title,
-      m_cookie_store.get_cookies_list(url),
-      response_time);
+      response->cookies.value(),
+      response_time,
+      patches,
+      m_prefetch);
+
+    if (!patches) {
+      m_html_patch_cache.set(patches_key, patcher.patches(), to_local_filename(url));
+      if (m_prefetch)
+        prefetch(patcher.subresource_urls());
+    }
 
-    patched_data.emplace(
-      convert_charset(patcher.get_patched(), "utf-8", (charset.empty() ? "utf-8" : charset)));
-    data = as_byte_view(patched_data.value());
+    response->buffer = patcher.get_patched();
+    if (convert)
+      response->buffer = convert_charset(std::move(response->buffer), "utf-8", charset);
+    response->data = as_byte_view(response->buffer);
   }
 
-  auto response_header = Header();
-  auto cors_allow_origin = std::string_view();
-  auto cors_allow_credentials = false;
+  auto& response_header = response->header;
   for (const auto& [name, value] : header)
     if (iequals(name, "Location")) {
       const auto location = to_absolute_url(value, url);
@@ -381,17 +752,19 @@ void Logic::serve_file(Server::Request& request, const std::string& url,
       response_header.emplace(name, content_type);
     }
     else if (iequals(name, "Content-Length")) {
-      response_header.emplace(name, std::to_string(data.size()));
+      response_header.emplace(name, std::to_string(response->data.size()));
     }
     else if (iequals(name, "Strict-Transport-Security")) {
+      response->strict_transport_security =
+        (value.find("includeSubDomains") != std::string::npos);
       set_strict_transport_security(url,
-        (value.find("includeSubDomains") != std::string::npos));
+        response->strict_transport_security.value());
     }
     else if (iequals(name, "Access-Control-Allow-Credentials")) {
-      cors_allow_credentials = (value == "true");
+      response->cors_allow_credentials = (value == "true");
     }
     else if (iequals(name, "Access-Control-Allow-Origin")) {
-      cors_allow_origin = (value == "*" ? value : m_local_server_base);
+      response->cors_allow_origin = (value == "*" ? value : m_local_server_base);
     }
     else if (!iequals_any(name,
           "Set-Cookie",
@@ -405,23 +778,32 @@ void Logic::serve_file(Server::Request& request, const std::string& url,
       response_header.emplace(name, value);
     }
 
+  response_header.emplace("Connection", "keep-alive");
+  response_header.emplace("Cache-Control", "no-store");
+  return response;
+}
+
+void Logic::send_prepared_response(Server::Request& request,
+    const std::string& url, const PreparedResponse& response) {
+
+  auto cors_allow_origin = std::string_view(response.cors_allow_origin);
   if (auto it = request.header().find("Origin"); it != request.header().end())
     cors_allow_origin = it->second;
 
-  if (!cors_allow_origin.empty() || cors_allow_credentials) {
-    if (cors_allow_credentials) {
+  if (!cors_allow_origin.empty() || response.cors_allow_credentials) {
+    auto response_header = response.header;
+    if (response.cors_allow_credentials) {
       response_header.emplace("Access-Control-Allow-Origin", cors_allow_origin);
       response_header.emplace("Access-Control-Allow-Credentials", "true");
     }
     else {
       response_header.emplace("Access-Control-Allow-Origin", "*");
     }
+    request.send_response(response.status_code, response_header, response.data);
+  }
+  else {
+    request.send_response(response.status_code, response.header, response.data);
   }
-
-  response_header.emplace("Connection", "keep-alive");
-  response_header.emplace("Cache-Control", "no-store");
-
-  request.send_response(status_code, response_header, data);
 
   log(Event::served, url);
   if (m_settings.verbose)
@@ -457,11 +839,23 @@ void Logic::set_strict_transport_security(const std::string& url, bool sub_domai
 
 void Logic::async_write_file(const std::string& identifying_url,
     StatusCode status_code, const Header& header, ByteView data,
-    time_t response_time, bool allow_lossy_compression,
-    std::function<void(bool)>&& on_complete) {
+    const std::optional<DeflateStream>& deflated, time_t response_time,
+    bool allow_lossy_compression, std::function<void(bool)>&& on_complete) {
   auto lock = std::lock_guard(m_write_mutex);
   const auto filename = to_local_filename(identifying_url);
   if (m_archive_writer && !m_archive_writer->contains(filename)) {
+    // store deflate stream of gzip encoded data without recompressing
+    if (deflated) {
+      auto decoded_header = header;
+      decoded_header.erase("Content-Encoding");
+      decoded_header.erase("Content-Length");
+      decoded_header.emplace("Content-Length",
+        std::to_string(deflated->uncompressed_size));
+      m_header_writer.write(identifying_url, status_code, std::move(decoded_header));
+      return m_archive_writer->async_write(filename,
+        deflated.value(), response_time, std::move(on_complete));
+    }
+
     m_header_writer.write(identifying_url, status_code, header);
     if (!data.empty())
       return m_archive_writer->async_write(
@@ -482,13 +876,28 @@ void Logic::append_unrequested_files() {
   // top is the first and base is the latest archived
   m_archive_reader->set_overlay_path(first_overlay_path);
 
-  for (const auto& [identifying_url, entry] : m_header_reader.entries()) {
+  struct CopyFile {
+    std::string filename;
+    ArchiveReader::FileVersion version;
+    std::string target_filename;
+  };
+  auto copy_files = std::vector<CopyFile>();
+
+  m_header_reader.for_each_entry([&](const std::string& identifying_url,
+      const HeaderStore::Entry& entry) {
     if (m_blocked_hosts && m_blocked_hosts->contains(identifying_url))
-      continue;
+      return;
 
     const auto filename = to_local_filename(identifying_url);
     auto base_modification_time = m_archive_writer->get_modification_time(filename);
 
+    // files are still in input, only keep their headers
+    if (m_append_to_input) {
+      if (!base_modification_time.has_value())
+        m_header_writer.write(identifying_url, entry.status_code, entry.header);
+      return;
+    }
+
     if (!base_modification_time.has_value()) {
       // write base
       m_header_writer.write(identifying_url, entry.status_code, entry.header);
@@ -497,10 +906,8 @@ void Logic::append_unrequested_files() {
         ArchiveReader::top : ArchiveReader::base);
 
       if (const auto info = m_archive_reader->get_file_info(filename, version))
-        if (auto data = m_archive_reader->read(filename, version); !data.empty()) {
-          const auto data_view = ByteView(data);
-          m_archive_writer->async_write(filename, data_view, 
-            info->modification_time, false, [data = std::move(data)](bool) { });
+        if (info->uncompressed_size) {
+          copy_files.push_back({ filename, version, filename });
           base_modification_time = info->modification_time;
         }
     }
@@ -508,14 +915,17 @@ void Logic::append_unrequested_files() {
     if (m_settings.archive_policy == ArchivePolicy::latest_and_first) {
       // write first
       const auto info = m_archive_reader->get_file_info(filename, ArchiveReader::top);
-      if (info && info->modification_time != base_modification_time)
-        if (auto data = m_archive_reader->read(filename, ArchiveReader::top); !data.empty()) {
-          const auto data_view = ByteView(data);
-          m_archive_writer->async_write(first_overlay_path + filename, data_view, 
-            info->modification_time, false, [data = std::move(data)](bool) { });
-        }
+      if (info && info->uncompressed_size &&
+          info->modification_time != base_modification_time)
+        copy_files.push_back({ filename, ArchiveReader::top,
+          first_overlay_path + filename });
     }
-  }
+  });
+
+  const auto on_complete = get_progress_callback(copy_files.size(), "merged");
+  for (const auto& file : copy_files)
+    copy_archived_file(*m_archive_reader, *m_archive_writer,
+      file.filename, file.version, file.target_filename, false, on_complete);
 }
 
 FileRequestAction get_file_request_action(const Settings& settings,
@@ -573,3 +983,82 @@ FileRequestAction get_file_request_action(const Settings& settings,
 
   return { serve, write, download };
 }
+
+void compact_archive(const Settings& settings) {
+  const auto input_file = utf8_to_path(
+    get_legal_filename(path_to_utf8(settings.input_file)));
+  const auto output_file = utf8_to_path(
+    get_legal_filename(path_to_utf8(settings.output_file)));
+
+  auto error = std::error_code{ };
+  const auto input_size = std::filesystem::file_size(input_file, error);
+  auto reader = ArchiveReader();
+  if (error || !reader.open(input_file))
+    throw std::runtime_error("reading file failed");
+
+  auto writer = ArchiveWriter();
+  for (auto i = 0; i < 5; ++i)
+    if (writer.open(generate_temporary_filename("webrecorder-")))
+      break;
+  if (!writer.is_open())
+    throw std::runtime_error("opening temporary file failed");
+  writer.move_on_close(output_file, true);
+  writer.set_compression_level(settings.compression_level);
+  // keep files deduplicated, which were deduplicated while recording
+  writer.set_deduplicate(settings.deduplicate || reader.has_aliases());
+
+  auto headers = HeaderStore();
+  headers.deserialize(as_string_view(reader.read("headers")));
+
+  // only keep files which are referenced by headers,
+  // and first versions which differ from the latest
+  reader.set_overlay_path(first_overlay_path);
+  auto copy_files = std::vector<std::pair<std::string, ArchiveReader::FileVersion>>();
+  for (auto filename : { "uid", "url", "headers", "cookies" })
+    if (reader.get_file_info(filename, ArchiveReader::base))
+      copy_files.emplace_back(filename, ArchiveReader::base);
+
+  headers.for_each_entry([&](const std::string& identifying_url,
+      const HeaderStore::Entry&) {
+    const auto filename = to_local_filename(identifying_url);
+    const auto base = reader.get_file_info(filename, ArchiveReader::base);
+    if (base)
+      copy_files.emplace_back(filename, ArchiveReader::base);
+
+    const auto first = reader.get_file_info(filename, ArchiveReader::overlay);
+    if (first && (!base || first->crc32 != base->crc32 ||
+                  first->uncompressed_size != base->uncompressed_size))
+      copy_files.emplace_back(filename, ArchiveReader::overlay);
+  });
+
+  // files which were stored to record faster are compressed
+  const auto compress_stored = (settings.compression_level != 0);
+  const auto on_complete = get_progress_callback(copy_files.size(), "compacted");
+  for (const auto& [filename, version] : copy_files)
+    copy_archived_file(reader, writer, filename, version,
+      (version == ArchiveReader::overlay ? first_overlay_path + filename : filename),
+      compress_stored, on_complete);
+
+  // only keep patches of kept documents
+  auto patch_cache = HtmlPatchCache();
+  patch_cache.deserialize(as_string_view(reader.read("patches")));
+  auto copied_filenames = std::set<std::string_view>();
+  for (const auto& [filename, version] : copy_files)
+    copied_filenames.insert(filename);
+  const auto patches = patch_cache.serialize([&](const std::string& filename) {
+    return (copied_filenames.count(filename) != 0);
+  });
+  if (!patches.empty())
+    writer.write("patches", as_byte_view(patches));
+
+  // pending writes reference the mapped input file
+  writer.flush();
+  reader.close();
+  if (!writer.close())
+    throw std::runtime_error("writing file failed");
+
+  const auto output_size = std::filesystem::file_size(output_file, error);
+  if (!error && output_size <= input_size)
+    log(Event::info, "compacted ", path_to_utf8(output_file), ", saved ",
+      std::to_string(input_size - output_size), " bytes");
+}
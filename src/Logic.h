@@ -7,7 +7,11 @@
 #include "Archive.h"
 #include "Settings.h"
 #include "CacheInfo.h"
+#include "ResponseCache.h"
+#include "HtmlPatcher.h"
+#include "ThreadPool.h"
 #include <regex>
+#include <deque>
 
 struct Settings;
 class HostList;
@@ -37,22 +41,40 @@ private:
   void serve_error(Server::Request& request, const std::string& url,
     StatusCode status_code);
   void handle_file_request(Server::Request request, const std::string& url);
+  [[nodiscard]] bool is_expensive_to_serve(const std::string& identifying_url);
   void forward_request(Server::Request request, const std::string& url,
     const std::optional<CacheInfo>& cache_info);
-  void handle_response(Server::Request& request,
-    const std::string& url, Client::Response response);
+  void handle_response(std::shared_ptr<Server::Request> request,
+    const std::string& url, uint64_t download_id, Client::Response response);
+  [[nodiscard]] bool is_expensive_to_patch(const Client::Response& response);
+  void serve_downloaded(Server::Request* request, const std::string& url,
+    const std::string& identifying_url,
+    const std::vector<std::shared_ptr<Server::Request>>& coalesced,
+    Client::Response response);
+  [[nodiscard]] bool coalesce_download(const std::string& identifying_url,
+    Server::Request& request, bool accepts_gzip, uint64_t& download_id);
+  std::vector<std::shared_ptr<Server::Request>> take_coalesced_requests(
+    const std::string& identifying_url, uint64_t download_id);
+  void prefetch(const std::vector<std::string>& urls);
+  void start_prefetches();
   [[nodiscard]] bool serve_previously_served(Server::Request& request, const std::string& url);
   [[nodiscard]] bool serve_from_archive(Server::Request& request, const std::string& url,
     bool write_to_archive);
   void serve_file(Server::Request& request, const std::string& url,
     StatusCode status_code, const Header& header, ByteView data, time_t response_time);
+  std::shared_ptr<PreparedResponse> prepare_response(const std::string& url,
+    StatusCode status_code, const Header& header, ByteView data, time_t response_time);
+  void send_prepared_response(Server::Request& request, const std::string& url,
+    const PreparedResponse& response);
+  std::shared_ptr<const PreparedResponse> get_cached_response(
+    const std::string& identifying_url, const std::string& url);
   void handle_initial_redirects(const std::string& url,
     const StatusCode status_code, const Header& header);
   void set_strict_transport_security(const std::string& url, bool include_subdomains);
   void async_write_file(const std::string& identifying_url,
     StatusCode status_code, const Header& header, ByteView data,
-    time_t response_time, bool allow_lossy_compression,
-    std::function<void(bool)>&& on_complete);
+    const std::optional<DeflateStream>& deflated, time_t response_time,
+    bool allow_lossy_compression, std::function<void(bool)>&& on_complete);
   void append_unrequested_files();
 
   // only updated while single threaded
@@ -66,16 +88,31 @@ private:
   std::string m_server_base;
   std::string m_server_base_path;
   std::function<void()> m_start_threads_callback;
+  bool m_append_to_input{ };
+  bool m_prefetch{ };
 
   // threadsafe
   Client m_client;
   CookieStore m_cookie_store;
+  std::unique_ptr<ResponseCache> m_response_cache;
+  std::unique_ptr<ThreadPool> m_compute_pool;
+  HtmlPatchCache m_html_patch_cache;
 
   // modifications sequenced by mutex
   mutable std::mutex m_write_mutex;
   std::unique_ptr<ArchiveWriter> m_archive_writer;
   HeaderStore m_header_writer;
   std::map<std::string, std::regex, std::less<void>> m_strict_transport_security;
+  struct PendingDownload {
+    // only the download which added the entry takes it
+    uint64_t download_id;
+    bool gzip_passthrough;
+    std::vector<std::shared_ptr<Server::Request>> requests;
+  };
+  std::map<std::string, PendingDownload, std::less<void>> m_pending_downloads;
+  uint64_t m_next_download_id{ };
+  std::deque<std::pair<std::string, uint64_t>> m_prefetch_queue;
+  int m_prefetches_running{ };
 };
 
 struct FileRequestAction {
@@ -86,3 +123,6 @@ struct FileRequestAction {
 
 FileRequestAction get_file_request_action(
   const Settings& settings, bool archived,  bool expired);
+
+// rewrites archive without unreferenced files and redundant first versions
+void compact_archive(const Settings& settings);
@@ -0,0 +1,53 @@
+#include "ResponseCache.h"
+
+ResponseCache::ResponseCache(size_t max_size)
+  : m_max_size(max_size) {
+}
+
+size_t ResponseCache::get_size(const Entry& entry) {
+  const auto& [key, response] = entry;
+  auto size = key.size() + response->data.size();
+  for (const auto& [name, value] : response->header)
+    size += name.size() + value.size();
+  return size;
+}
+
+std::shared_ptr<const PreparedResponse> ResponseCache::get(const std::string& key) {
+  auto lock = std::lock_guard(m_mutex);
+  const auto it = m_index.find(key);
+  if (it == m_index.end())
+    return nullptr;
+
+  // move to front
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  return it->second->second;
+}
+
+void ResponseCache::put(const std::string& key,
+    std::shared_ptr<const PreparedResponse> response) {
+  auto lock = std::lock_guard(m_mutex);
+  if (auto it = m_index.find(key); it != m_index.end()) {
+    m_size -= get_size(*it->second);
+    m_entries.erase(it->second);
+    m_index.erase(it);
+  }
+
+  auto entry = Entry(key, std::move(response));
+  const auto size = get_size(entry);
+  if (size > m_max_size)
+    return;
+
+  m_entries.push_front(std::move(entry));
+  m_index.emplace(m_entries.front().first, m_entries.begin());
+  m_size += size;
+  evict();
+}
+
+void ResponseCache::evict() {
+  while (m_size > m_max_size) {
+    const auto& entry = m_entries.back();
+    m_size -= get_size(entry);
+    m_index.erase(entry.first);
+    m_entries.pop_back();
+  }
+}
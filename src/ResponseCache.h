@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Server.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+struct PreparedResponse {
+  StatusCode status_code{ };
+  Header header;
+  ByteView data;
+  std::string buffer;
+  std::string cors_allow_origin;
+  bool cors_allow_credentials{ };
+  std::optional<bool> strict_transport_security;
+  // cookies which were patched into HTML
+  std::optional<std::string> cookies;
+};
+
+class ResponseCache final {
+public:
+  explicit ResponseCache(size_t max_size);
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  std::shared_ptr<const PreparedResponse> get(const std::string& key);
+  void put(const std::string& key, std::shared_ptr<const PreparedResponse> response);
+
+private:
+  using Entry = std::pair<std::string, std::shared_ptr<const PreparedResponse>>;
+
+  static size_t get_size(const Entry& entry);
+  void evict();
+
+  const size_t m_max_size;
+  std::mutex m_mutex;
+  size_t m_size{ };
+  std::list<Entry> m_entries;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> m_index;
+};
@@ -26,6 +26,15 @@ struct Server::Impl : public HttpServer {
   std::mutex thread_mutex;
   std::exception_ptr thread_exception;
 
+  std::unique_ptr<asio::steady_timer> adapt_timer;
+  bool adapt_stopped{ };
+  std::vector<std::thread::id> exited_threads;
+  std::atomic<int> adaptive_thread_count{ };
+  std::atomic<int> adaptive_thread_target{ };
+  int min_thread_count{ };
+  int max_thread_count{ };
+  int idle_intervals{ };
+
   void start() {
     io_service = sole_io_service();
     stop_signals = std::make_unique<asio::signal_set>(*io_service,
@@ -75,11 +84,20 @@ struct Server::Impl : public HttpServer {
   }
 
   void join_threads() {
-    for (auto& thread : threads)
+    auto joining = std::vector<std::thread>();
+    {
+      auto lock = std::lock_guard(thread_mutex);
+      adapt_stopped = true;
+      if (adapt_timer)
+        adapt_timer->cancel();
+      joining.swap(threads);
+      exited_threads.clear();
+    }
+    for (auto& thread : joining)
       if (thread.joinable())
         thread.join();
-    threads.clear();
 
+    auto lock = std::lock_guard(thread_mutex);
     if (thread_exception)
       std::rethrow_exception(thread_exception);
   }
@@ -97,6 +115,88 @@ struct Server::Impl : public HttpServer {
         }
       });
   }
+
+  void run_adaptive_threads(int min_count, int max_count) {
+    min_thread_count = std::max(min_count, 1);
+    max_thread_count = std::max(max_count, min_thread_count);
+    adaptive_thread_target = min_thread_count;
+    auto lock = std::lock_guard(thread_mutex);
+    for (auto i = 0; i < min_thread_count; ++i)
+      add_adaptive_thread();
+
+    adapt_timer = std::make_unique<asio::steady_timer>(*io_service);
+    schedule_adapt();
+  }
+
+  // thread_mutex has to be locked
+  void add_adaptive_thread() {
+    ++adaptive_thread_count;
+    threads.emplace_back([this]() noexcept {
+      try {
+        // exit after a handler, when there are more threads than wanted
+        while (io_service->run_one()) {
+          auto count = adaptive_thread_count.load();
+          if (count > adaptive_thread_target &&
+              adaptive_thread_count.compare_exchange_strong(count, count - 1)) {
+            auto lock = std::lock_guard(thread_mutex);
+            exited_threads.push_back(std::this_thread::get_id());
+            return;
+          }
+        }
+      }
+      catch (const std::exception& ex) {
+        auto lock = std::lock_guard(thread_mutex);
+        thread_exception = std::make_exception_ptr(ex);
+      }
+      --adaptive_thread_count;
+    });
+  }
+
+  // thread_mutex has to be locked
+  void join_exited_threads() {
+    for (const auto& id : exited_threads) {
+      const auto it = std::find_if(threads.begin(), threads.end(),
+        [&](const std::thread& thread) { return thread.get_id() == id; });
+      if (it != threads.end()) {
+        it->join();
+        threads.erase(it);
+      }
+    }
+    exited_threads.clear();
+  }
+
+  // thread_mutex has to be locked
+  void schedule_adapt() {
+    const auto interval = std::chrono::milliseconds(100);
+    adapt_timer->expires_after(interval);
+    adapt_timer->async_wait([this](const SimpleWeb::error_code& error) {
+      auto lock = std::lock_guard(thread_mutex);
+      if (error || adapt_stopped)
+        return;
+
+      join_exited_threads();
+
+      // handlers waiting for a thread delay the timer
+      const auto delay = std::chrono::steady_clock::now() - adapt_timer->expiry();
+      if (delay > std::chrono::milliseconds(20)) {
+        idle_intervals = 0;
+        if (adaptive_thread_target < max_thread_count) {
+          ++adaptive_thread_target;
+          add_adaptive_thread();
+        }
+      }
+      else if (delay < std::chrono::milliseconds(2)) {
+        // remove a thread after about 5 seconds without delays
+        if (++idle_intervals >= 50 && adaptive_thread_target > min_thread_count) {
+          idle_intervals = 0;
+          --adaptive_thread_target;
+          // wake a thread, so it can exit
+          io_service->post([]() { });
+        }
+      }
+      schedule_adapt();
+    });
+  }
 };
 
 //-------------------------------------------------------------------------
@@ -145,7 +245,15 @@ void Server::Request::send_response(StatusCode status_code,
   assert(!response_sent());
   if (m_impl->response) {
     m_impl->response->write(status_code, as_string_view(data), header);
-    m_impl->response.reset();
+
+    // response is sent when it is released, which has to be on an I/O thread
+    const auto io_service = sole_io_service();
+    if (io_service->get_executor().running_in_this_thread())
+      m_impl->response.reset();
+    else
+      io_service->post([response = std::move(m_impl->response)]() mutable {
+        response.reset();
+      });
   }
 }
 
@@ -176,6 +284,10 @@ void Server::run_threads(int thread_count) {
   m_impl->run_threads(thread_count);
 }
 
+void Server::run_adaptive_threads(int min_thread_count, int max_thread_count) {
+  m_impl->run_adaptive_threads(min_thread_count, max_thread_count);
+}
+
 void Server::run(int port, const HandleAccepting& handle_accepting) {
   m_impl->run(port, handle_accepting);
   m_impl->join_threads();
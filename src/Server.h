@@ -51,6 +51,8 @@ public:
   int port() const;
   void run(int port, const HandleAccepting& handle_accepting);
   void run_threads(int thread_count);
+  // adds and removes threads depending on the delay of scheduled handlers
+  void run_adaptive_threads(int min_thread_count, int max_thread_count);
 
 private:
   struct Impl;
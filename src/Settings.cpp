@@ -2,6 +2,7 @@
 #include "Settings.h"
 #include "common.h"
 #include <regex>
+#include <thread>
 
 bool interpret_commandline(Settings& settings, int argc, const char* argv[]) {
   for (auto i = 1; i < argc; i++) {
@@ -117,7 +118,56 @@ bool interpret_commandline(Settings& settings, int argc, const char* argv[]) {
         return false;
       settings.request_timeout = std::chrono::seconds(timeout);
     }
+    else if (argument == "--max-idle-connections") {
+      if (++i >= argc)
+        return false;
+      const auto count = std::atoi(unquote(argv[i]).data());
+      if (count < 0)
+        return false;
+      settings.max_idle_connections = count;
+    }
+    else if (argument == "--idle-timeout") {
+      if (++i >= argc)
+        return false;
+      const auto timeout = std::atoi(unquote(argv[i]).data());
+      if (timeout <= 0)
+        return false;
+      settings.idle_connection_timeout = std::chrono::seconds(timeout);
+    }
+    else if (argument == "--response-cache") {
+      if (++i >= argc)
+        return false;
+      const auto size = std::atoi(unquote(argv[i]).data());
+      if (size < 0)
+        return false;
+      settings.response_cache_size_mb = size;
+    }
+    else if (argument == "--threads") {
+      if (++i >= argc)
+        return false;
+      const auto threads = unquote(argv[i]);
+      if (threads == "auto") {
+        settings.adaptive_threads = true;
+      }
+      else {
+        settings.threads = std::atoi(threads.data());
+        if (settings.threads <= 0)
+          return false;
+      }
+    }
+    else if (argument == "--compression-level") {
+      if (++i >= argc)
+        return false;
+      const auto level = std::atoi(unquote(argv[i]).data());
+      if (level < 0 || level > 9)
+        return false;
+      settings.compression_level = level;
+    }
     else if (argument == "--allow-lossy-compression") { settings.allow_lossy_compression = true; }
+    else if (argument == "--deduplicate") { settings.deduplicate = true; }
+    else if (argument == "--append") { settings.append = true; }
+    else if (argument == "--compact") { settings.compact = true; }
+    else if (argument == "--prefetch") { settings.prefetch = true; }
     else if (argument == "--open-browser") { settings.open_browser = true; }
     else if (argument == "-h" || argument == "--help") {
       return false;
@@ -150,6 +200,13 @@ bool interpret_commandline(Settings& settings, int argc, const char* argv[]) {
   return true;
 }
 
+int get_max_thread_count(const Settings& settings) {
+  const auto cores = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+  if (settings.adaptive_threads)
+    return cores * 4;
+  return (settings.threads > 0 ? settings.threads : cores);
+}
+
 void print_help_message(const char* argv0) {
   auto program = std::string(argv0);
   if (auto i = program.rfind('/'); i != std::string::npos)
@@ -189,9 +246,19 @@ void print_help_message(const char* argv0) {
     "                                 requested\n"
     "  --refresh-timeout <secs>   refresh timeout (default: %i).\n"
     "  --request-timeout <secs>   request timeout (default: %i).\n"
+    "  --max-idle-connections <n> idle connections kept per host (default: %i).\n"
+    "  --idle-timeout <secs>      idle connection timeout (default: %i).\n"
+    "  --response-cache <MB>      size of served response cache (default: %i).\n"
+    "  --threads <n|auto>         server threads, auto adapts to load (default: cores).\n"
+    "  --compression-level <0-9>  compression level, 0 stores (default: %i).\n"
     "  --localhost <hostname>     set hostname of local server (default: %s).\n"
     "  --port <port>              set port of local server.\n"
     "  --allow-lossy-compression  allow lossy compression of big images.\n"
+    "  --deduplicate              store files with identical content only once,\n"
+    "                                 duplicates are not listed by zip tools.\n"
+    "  --append                   append changes to file instead of rewriting it.\n"
+    "  --compact                  remove unreferenced and redundant files from file.\n"
+    "  --prefetch                 download linked resources before they are requested.\n"
     "  --block-hosts-file <file>  block hosts in file.\n"
     "  --inject-js-file <file>    inject JavaScript in every HTML file.\n"
     "  --patch-base-tag           patch base tag so URLs are relative to original host.\n"
@@ -205,5 +272,9 @@ void print_help_message(const char* argv0) {
     "\n", version, program.c_str(),
     static_cast<int>(defaults.refresh_timeout.count()),
     static_cast<int>(defaults.request_timeout.count()),
+    defaults.max_idle_connections,
+    static_cast<int>(defaults.idle_connection_timeout.count()),
+    defaults.response_cache_size_mb,
+    defaults.compression_level,
     defaults.localhost.c_str());
 }
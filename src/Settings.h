@@ -35,13 +35,25 @@ struct Settings {
   bool patch_title{ };
   std::string proxy_server;
   bool allow_lossy_compression{ };
+  int compression_level{ 6 };
+  bool deduplicate{ };
+  bool append{ };
+  bool compact{ };
+  bool prefetch{ };
   DownloadPolicy download_policy{ };
   ServePolicy serve_policy{ };
   ArchivePolicy archive_policy{ };
   std::chrono::seconds refresh_timeout{ 1 };
   std::chrono::seconds request_timeout{ 5 };
+  int max_idle_connections{ 4 };
+  std::chrono::seconds idle_connection_timeout{ 10 };
+  int response_cache_size_mb{ 64 };
+  int threads{ };  // 0 uses number of cores
+  bool adaptive_threads{ };
   bool open_browser{ };
 };
 
 bool interpret_commandline(Settings& settings, int argc, const char* argv[]);
+// maximum number of threads serving requests, including main thread
+int get_max_thread_count(const Settings& settings);
 void print_help_message(const char* argv0);
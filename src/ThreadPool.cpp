@@ -0,0 +1,39 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int thread_count) {
+  if (thread_count <= 0)
+    thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (auto i = 0; i < thread_count; ++i)
+    m_threads.emplace_back(&ThreadPool::thread_func, this);
+}
+
+ThreadPool::~ThreadPool() {
+  auto lock = std::unique_lock(m_tasks_mutex);
+  m_finish = true;
+  lock.unlock();
+  m_tasks_signal.notify_all();
+  for (auto& thread : m_threads)
+    thread.join();
+}
+
+void ThreadPool::post(std::function<void()>&& task) {
+  auto lock = std::unique_lock(m_tasks_mutex);
+  m_tasks.emplace_back(std::move(task));
+  lock.unlock();
+  m_tasks_signal.notify_one();
+}
+
+void ThreadPool::thread_func() {
+  for (;;) {
+    auto lock = std::unique_lock(m_tasks_mutex);
+    m_tasks_signal.wait(lock,
+      [&]() { return m_finish || !m_tasks.empty(); });
+    if (m_tasks.empty())
+      break;
+    auto task = std::move(m_tasks.front());
+    m_tasks.pop_front();
+    lock.unlock();
+    task();
+  }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+
+class ThreadPool final {
+public:
+  explicit ThreadPool(int thread_count = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  int thread_count() const { return static_cast<int>(m_threads.size()); }
+  void post(std::function<void()>&& task);
+
+private:
+  void thread_func();
+
+  std::mutex m_tasks_mutex;
+  std::condition_variable m_tasks_signal;
+  std::deque<std::function<void()>> m_tasks;
+  bool m_finish{ };
+  std::vector<std::thread> m_threads;
+};
@@ -1,7 +1,9 @@
 
 #include "common.h"
 #include "libs/utf8/utf8.h"
+#include "zlib.h"
 #include <array>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <iomanip>
@@ -33,23 +35,58 @@ extern "C" int siphash(const uint8_t* in, const size_t inlen,
 # include <iconv.h>
 # include <optional>
 
+# include <map>
+
+namespace {
+  const auto iconv_error = ~size_t{ };
+
+  // descriptors are cached per thread
+  class IconvCache {
+  public:
+    ~IconvCache() {
+      for (const auto& [key, conv] : m_descriptors)
+        ::iconv_close(conv);
+    }
+
+    std::optional<iconv_t> get(std::string_view from, std::string_view to) {
+      auto key = std::string(from);
+      key.push_back(' ');
+      key.append(to);
+      if (auto it = m_descriptors.find(key); it != m_descriptors.end())
+        return it->second;
+
+      const auto conv = ::iconv_open(std::string(to).c_str(), std::string(from).c_str());
+      if (reinterpret_cast<uintptr_t>(conv) == iconv_error)
+        return std::nullopt;
+      m_descriptors.emplace(std::move(key), conv);
+      return conv;
+    }
+
+  private:
+    std::map<std::string, iconv_t, std::less<>> m_descriptors;
+  };
+} // namespace
+
 inline std::optional<std::string> convert_charset_iconv(std::string_view string,
     std::string_view from, std::string_view to) {
-  const auto error = ~size_t{ };
-
-  const auto conv = ::iconv_open(std::string(to).c_str(), std::string(from).c_str());
-  if (reinterpret_cast<uintptr_t>(conv) == error)
+  thread_local auto iconv_cache = IconvCache();
+  const auto conv = iconv_cache.get(from, to);
+  if (!conv)
     return std::nullopt;
 
+  // reset conversion state
+  ::iconv(*conv, nullptr, nullptr, nullptr, nullptr);
+
   auto source_pointer = const_cast<char*>(string.data());
   auto source_size = string.size();
   auto dest = std::string();
-  auto dest_buffer = std::vector<char>(1024);
+  dest.reserve(string.size());
+  auto dest_buffer = std::vector<char>(4096);
   while (source_size > 0) {
     auto dest_pointer = dest_buffer.data();
     auto dest_size = dest_buffer.size();
-    if (::iconv(conv, &source_pointer,
-        &source_size, &dest_pointer, &dest_size) == error) {
+    if (::iconv(*conv, &source_pointer,
+        &source_size, &dest_pointer, &dest_size) == iconv_error) {
       if (errno != E2BIG) {
         ++source_pointer;
         --source_size;
@@ -57,7 +94,6 @@ inline std::optional<std::string> convert_charset_iconv(std::string_view string,
     }
     dest.append(dest_buffer.data(), dest_buffer.size() - dest_size);
   }
-  ::iconv_close(conv);
   return { std::move(dest) };
 }
 #endif // USE_ICONV
@@ -78,6 +114,112 @@ std::string convert_charset(ByteView data, std::string_view from, std::string_vi
   return std::string(as_string_view(data));
 }
 
+bool is_ascii(ByteView data) {
+  // check blocks of 32 bytes, as four 64 bit words
+  const auto high_bits = uint64_t{ 0x8080808080808080ull };
+  auto begin = reinterpret_cast<const char*>(data.data());
+  const auto end = begin + data.size();
+  auto bits = uint64_t{ };
+  for (; end - begin >= 32; begin += 32) {
+    auto words = std::array<uint64_t, 4>{ };
+    std::memcpy(words.data(), begin, sizeof(words));
+    bits |= (words[0] | words[1] | words[2] | words[3]);
+    if (bits & high_bits)
+      return false;
+  }
+  for (; begin != end; ++begin)
+    bits |= static_cast<uint8_t>(*begin);
+  return !(bits & high_bits);
+}
+
+bool is_utf8_compatible(ByteView data, std::string_view charset) {
+  if (charset.empty() || iequals_any(charset, "utf-8", "utf8"))
+    return true;
+
+  // ASCII is unchanged by conversion, unless the charset is not a superset
+  for (auto prefix : { "utf-16", "utf-32", "utf-7", "ucs-", "iso-2022", "hz-" })
+    if (iequals(charset.substr(0, std::strlen(prefix)), prefix))
+      return false;
+  return is_ascii(data);
+}
+
+namespace {
+  // inflates into a small buffer, to verify the size and checksum
+  bool is_complete_deflate_stream(const DeflateStream& deflate) {
+    auto stream = z_stream{ };
+    if (::inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+      return false;
+    auto guard = std::shared_ptr<void>(nullptr, [&](auto) { ::inflateEnd(&stream); });
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<std::byte*>(deflate.data.data()));
+    stream.avail_in = static_cast<uInt>(deflate.data.size());
+    auto buffer = std::array<Bytef, 16384>();
+    auto crc = ::crc32(0, nullptr, 0);
+    for (;;) {
+      stream.next_out = buffer.data();
+      stream.avail_out = static_cast<uInt>(buffer.size());
+      const auto result = ::inflate(&stream, Z_NO_FLUSH);
+      crc = ::crc32(crc, buffer.data(),
+        static_cast<uInt>(buffer.size() - stream.avail_out));
+      if (result == Z_STREAM_END)
+        break;
+      if (result != Z_OK)
+        return false;
+    }
+    // stream has to end exactly at the trailer
+    return (stream.avail_in == 0 &&
+            static_cast<uint32_t>(crc) == deflate.crc32 &&
+            static_cast<uint32_t>(stream.total_out) == deflate.uncompressed_size);
+  }
+} // namespace
+
+std::optional<DeflateStream> get_gzip_deflate_stream(ByteView gzip) {
+  // see RFC 1952, only a single member without trailing data is accepted
+  const auto data = reinterpret_cast<const uint8_t*>(gzip.data());
+  const auto size = static_cast<size_t>(gzip.size());
+  const auto read_uint16 = [&](size_t pos) -> size_t {
+    return static_cast<size_t>(data[pos] | data[pos + 1] << 8);
+  };
+  const auto read_uint32 = [&](size_t pos) {
+    return static_cast<uint32_t>(read_uint16(pos) | read_uint16(pos + 2) << 16);
+  };
+  const auto skip_string = [&](size_t pos) {
+    while (pos < size && data[pos])
+      ++pos;
+    return pos + 1;
+  };
+  const auto header_size = size_t{ 10 };
+  const auto trailer_size = size_t{ 8 };
+  if (size < header_size + trailer_size ||
+      data[0] != 0x1F || data[1] != 0x8B || data[2] != 8)
+    return std::nullopt;
+
+  enum { FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08, FCOMMENT = 0x10 };
+  const auto flags = data[3];
+  auto pos = header_size;
+  if ((flags & FEXTRA) && pos + 2 <= size)
+    pos += 2 + read_uint16(pos);
+  if (flags & FNAME)
+    pos = skip_string(pos);
+  if (flags & FCOMMENT)
+    pos = skip_string(pos);
+  if (flags & FHCRC)
+    pos += 2;
+  if (pos + trailer_size > size)
+    return std::nullopt;
+
+  const auto trailer = size - trailer_size;
+  auto deflate = DeflateStream{
+    gzip.subspan(static_cast<ByteView::size_type>(pos),
+                 static_cast<ByteView::size_type>(trailer - pos)),
+    read_uint32(trailer),
+    read_uint32(trailer + 4),
+  };
+  if (!is_complete_deflate_stream(deflate))
+    return std::nullopt;
+  return deflate;
+}
+
 std::string get_hash(ByteView in) {
   auto out = uint64_t{ };
   auto k = std::array<uint8_t, 16>{ };
@@ -4,11 +4,18 @@
 #include <vector>
 #include <string>
 #include <filesystem>
+#include <optional>
 
 using ByteVector = std::vector<std::byte>;
 using ByteView = nonstd::span<const std::byte>;
 using StringViewPair = std::pair<std::string_view, std::string_view>;
 
+struct DeflateStream {
+  ByteView data;
+  uint32_t crc32;
+  uint32_t uncompressed_size;
+};
+
 struct LStringView : std::string_view {
   LStringView(std::string_view s) : std::string_view(s) { }
   LStringView(const char* s) : std::string_view(s) { }
@@ -41,6 +48,10 @@ StringViewPair split_content_type(std::string_view content_type);
 std::string get_content_type(std::string_view mime_type, std::string_view charset);
 std::string convert_charset(std::string data, std::string_view from, std::string_view to);
 std::string convert_charset(ByteView data, std::string_view from, std::string_view to);
+bool is_ascii(ByteView data);
+bool is_utf8_compatible(ByteView data, std::string_view charset);
+
+std::optional<DeflateStream> get_gzip_deflate_stream(ByteView gzip);
 
 std::string get_hash(ByteView in);
 std::string get_legal_filename(const std::string& filename);
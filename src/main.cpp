@@ -21,6 +21,11 @@ int run(int argc, const char* argv[]) noexcept try {
     return 1;
   }
 
+  if (settings.compact) {
+    compact_archive(settings);
+    return 0;
+  }
+
   auto logic = Logic(&settings);
 
   using namespace std::placeholders;
@@ -28,7 +33,14 @@ int run(int argc, const char* argv[]) noexcept try {
     std::bind(&Logic::handle_request, &logic, _1),
     std::bind(&Logic::handle_error, &logic, _1, _2));
 
-  logic.set_start_threads_callback([&]() { server.run_threads(5); });
+  // main thread also serves requests
+  const auto max_threads = get_max_thread_count(settings);
+  logic.set_start_threads_callback([&]() {
+    if (settings.adaptive_threads)
+      server.run_adaptive_threads(1, max_threads - 1);
+    else
+      server.run_threads(max_threads - 1);
+  });
 
   server.run(settings.port,
     [&](unsigned short port) {
@@ -14,6 +14,7 @@ void write_output(Event event) {
       case Event::redirect: return "REDIRECT";
       case Event::download_started: return "DOWNLOADING";
       case Event::download_omitted: return "DOWNLOAD_OMITTED";
+      case Event::download_coalesced: return "DOWNLOAD_COALESCED";
       case Event::download_finished: return "DOWNLOAD_FINISHED";
       case Event::download_failed: return "DOWNLOAD_FAILED";
       case Event::download_blocked: return "DOWNLOAD_BLOCKED";
@@ -33,7 +34,19 @@ std::string read_utf8_textfile(const std::filesystem::path& filename) {
   return { buffer.str() };
 }
 
+MappedFile::~MappedFile() {
+  close();
+}
+
+ByteView MappedFile::data() const {
+  return { m_data, static_cast<ByteView::size_type>(m_size) };
+}
+
 #if !defined(_WIN32)
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
 
 namespace {
   std::mutex g_output_mutex;
@@ -93,6 +106,31 @@ void open_browser(const std::string& url) {
     std::system(("open \"" + url + "\"").c_str());
 }
 
+bool MappedFile::open(const std::filesystem::path& filename) {
+  close();
+  const auto fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st{ };
+  if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+    const auto size = static_cast<size_t>(st.st_size);
+    const auto data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      m_data = static_cast<const std::byte*>(data);
+      m_size = size;
+    }
+  }
+  ::close(fd);
+  return is_open();
+}
+
+void MappedFile::close() {
+  if (m_data)
+    ::munmap(const_cast<std::byte*>(m_data), m_size);
+  m_data = nullptr;
+  m_size = 0;
+}
+
 int main(int argc, const char* argv[]) {
   return run(argc, argv);
 }
@@ -201,6 +239,35 @@ void open_browser(const std::string& url) {
     NULL, NULL, SW_SHOWNORMAL);
 }
 
+bool MappedFile::open(const std::filesystem::path& filename) {
+  close();
+  const auto file = CreateFileW(filename.wstring().c_str(), GENERIC_READ,
+    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  auto size = LARGE_INTEGER{ };
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+    const auto mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      if (const auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) {
+        m_data = static_cast<const std::byte*>(data);
+        m_size = static_cast<size_t>(size.QuadPart);
+      }
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  return is_open();
+}
+
+void MappedFile::close() {
+  if (m_data)
+    UnmapViewOfFile(m_data);
+  m_data = nullptr;
+  m_size = 0;
+}
+
 int wmain(int argc, wchar_t* wargv[]) {
   auto argv_strings = std::vector<std::string>();
   for (auto i = 0; i < argc; ++i)
@@ -11,6 +11,7 @@ enum class Event {
   redirect,
   download_started,
   download_omitted,
+  download_coalesced,
   download_finished,
   download_failed,
   download_blocked,
@@ -40,4 +41,21 @@ void log(Event event, Args&&... args) {
 
 void open_browser(const std::string& url);
 
+class MappedFile final {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  bool open(const std::filesystem::path& filename);
+  void close();
+  bool is_open() const { return (m_data != nullptr); }
+  ByteView data() const;
+
+private:
+  const std::byte* m_data{ };
+  size_t m_size{ };
+};
+
 extern int run(int argc, const char* argv[]) noexcept;
@@ -1,7 +1,11 @@
 
 #include "common.h"
 #include "Logic.h"
+#include "HtmlPatcher.h"
+#include "FileIndex.h"
+#include "platform.h"
 #include <csignal>
+#include <algorithm>
 
 namespace {
   template<typename A, typename B>
@@ -39,6 +43,28 @@ namespace {
     eq(url_from_input("www.a.com"), "http://www.a.com");
     eq(url_from_input("www.a.com/file.txt"), "http://www.a.com/file.txt");
 
+    eq(is_ascii(as_byte_view("")), true);
+    eq(is_ascii(as_byte_view("<html><head><title>abc</title></head></html>")), true);
+    eq(is_ascii(as_byte_view("<html><head><title>\xE4</title></head></html>")), false);
+    eq(is_utf8_compatible(as_byte_view("abc"), "iso-8859-1"), true);
+    eq(is_utf8_compatible(as_byte_view("\xE4"), "iso-8859-1"), false);
+    eq(is_utf8_compatible(as_byte_view("\xC3\xA4"), "UTF-8"), true);
+    eq(is_utf8_compatible(as_byte_view("abc"), "ISO-2022-JP"), false);
+
+    const auto gzip = std::string("\x1F\x8B\x08\x00\x00\x00\x00\x00\x02\x03"
+      "\xCB\x48\xCD\xC9\xC9\x07\x00\x86\xA6\x10\x36\x05\x00\x00\x00", 25);
+    eq(get_gzip_deflate_stream(as_byte_view(gzip))->uncompressed_size, 5u);
+    eq(get_gzip_deflate_stream(as_byte_view(gzip + gzip)).has_value(), false);
+    eq(get_gzip_deflate_stream(as_byte_view(gzip + '\0')).has_value(), false);
+    auto corrupted = gzip;
+    corrupted[17] = '\0';
+    eq(get_gzip_deflate_stream(as_byte_view(corrupted)).has_value(), false);
+
+#if defined(USE_ICONV)
+    eq(convert_charset(as_byte_view("\xE4"), "iso-8859-1", "utf-8"), "\xC3\xA4");
+    eq(convert_charset(as_byte_view("\xC3\xA4"), "utf-8", "iso-8859-1"), "\xE4");
+#endif
+
     eq(to_relative_url("http://www.a.com/", "http://www.a.com"), "/");
     eq(to_relative_url("http://www.a.com/file.txt", "http://www.a.com"), "/file.txt");
     eq(to_relative_url("http://www.a.com/sub/file.txt", "http://www.a.com"), "/sub/file.txt");
@@ -246,9 +272,326 @@ namespace {
     check_expired({      true,  false, false });
     check_not_expired({  true,  false, false });
   }
+
+  void test_header_store() {
+    auto store = HeaderStore();
+    store.write("http://www.a.com/b", StatusCode::success_ok,
+      { { "Content-Type", "text/html" }, { "Set-Cookie", "a=b" } });
+    store.write("http://www.a.com/a", StatusCode::redirection_found,
+      { { "Location", "http://www.a.com/b" } });
+
+    auto binary = HeaderStore();
+    binary.deserialize(store.serialize());
+    eq(binary.read("http://www.a.com/c"), nullptr);
+    eq(binary.read("http://www.a.com/a")->status_code, StatusCode::redirection_found);
+    eq(binary.read("http://www.a.com/b")->header.size(), 2u);
+    eq(binary.read("http://www.a.com/b")->header.find("content-type")->second, "text/html");
+    eq(binary.serialize().size(), store.serialize().size());
+
+    auto text = HeaderStore();
+    text.deserialize("302 http://www.a.com/a\r\n\tLocation:http://www.a.com/b\r\n");
+    eq(text.read("http://www.a.com/a")->header.find("Location")->second, "http://www.a.com/b");
+  }
+
+  void test_file_index() {
+    auto index = FileIndex<int>();
+    eq(index.find("file0"), nullptr);
+    for (auto i = 0; i < 100; ++i)
+      eq(index.insert("file" + std::to_string(i), i), true);
+    eq(index.size(), 100u);
+    eq(index.insert("file1", 0), false);
+    eq(*index.find("file1"), 1);
+    eq(index.insert_or_assign("file1", 101), false);
+    eq(*index.find("file1"), 101);
+    eq(*index.find("file", "42"), 42);
+    eq(index.find("file", "100"), nullptr);
+
+    auto values = std::vector<int>();
+    index.for_each([&](std::string_view filename, int value) {
+      if (filename == "file0" || filename == "file1" || filename == "file99")
+        values.push_back(value);
+    });
+    eq(values, std::vector<int>{ 0, 101, 99 });
+  }
+
+  void test_response_cache() {
+    const auto response = [](char c, size_t size) {
+      auto response = std::make_shared<PreparedResponse>();
+      response->buffer = std::string(size, c);
+      response->data = as_byte_view(response->buffer);
+      return response;
+    };
+
+    // size of entries is the size of key and data
+    auto cache = ResponseCache(30);
+    cache.put("a", response('a', 9));
+    cache.put("b", response('b', 9));
+    cache.put("c", response('c', 9));
+    eq(cache.get("a") != nullptr, true);
+    cache.put("d", response('d', 9));
+    eq(cache.get("b"), nullptr);
+    eq(cache.get("c") != nullptr, true);
+    eq(cache.get("a") != nullptr, true);
+    eq(cache.get("d") != nullptr, true);
+
+    cache.put("e", response('e', 30));
+    eq(cache.get("e"), nullptr);
+    cache.put("a", response('a', 19));
+    eq(cache.get("c"), nullptr);
+    eq(cache.get("a")->data.size(), 19u);
+    eq(cache.get("d") != nullptr, true);
+  }
+
+  void test_archive() {
+    const auto filename = generate_temporary_filename("webrecorder-test-");
+    const auto compacted = generate_temporary_filename("webrecorder-test-");
+    auto guard = std::shared_ptr<void>(nullptr, [&](auto) {
+      auto error = std::error_code{ };
+      std::filesystem::remove(filename, error);
+      std::filesystem::remove(compacted, error);
+    });
+    const auto time = time_t{ 1588262656 };
+    const auto succeeded = [](bool succeeded) { eq(succeeded, true); };
+    const auto read = [](const ArchiveReader& reader, const std::string& filename) {
+      return std::string(as_string_view(reader.read(filename)));
+    };
+    const auto data_offset = [](const ArchiveReader& reader, const std::string& filename) {
+      return reader.get_file_info(filename)->data_offset;
+    };
+
+    auto names = std::vector<std::string>();
+    auto contents = std::vector<std::string>();
+    for (auto i = size_t{ }; i < 20; ++i) {
+      names.push_back("http/www.a.com/file" + std::to_string(i) + ".txt");
+      contents.push_back(std::string(1000 + i, static_cast<char>('a' + i)));
+    }
+    auto headers = HeaderStore();
+    headers.write("http://www.a.com/a.txt", StatusCode::success_ok,
+      { { "Content-Type", "text/plain" } });
+    const auto serialized_headers = headers.serialize();
+
+    // same content, stored as gzip stream, deflated and uncompressed
+    const auto hello = std::string("hello");
+    const auto gzip = std::string("\x1F\x8B\x08\x00\x00\x00\x00\x00\x02\x03"
+      "\xCB\x48\xCD\xC9\xC9\x07\x00\x86\xA6\x10\x36\x05\x00\x00\x00", 25);
+    const auto deflated_file = std::string("http/www.a.com/a.txt");
+    const auto gzip_file = std::string("http/www.a.com/b.txt");
+    const auto stored_file = std::string("http/www.a.com/c.bin");
+
+    // different content with same size and CRC32
+    const auto same_crc32 = std::string("same checksum, other content");
+    const auto forged_crc32 = std::string("different content, abcde\xCD\x11\xE8\xED", 28);
+    const auto same_crc32_file = std::string("http/www.a.com/same.bin");
+    const auto forged_crc32_file = std::string("http/www.a.com/forged.bin");
+
+    // files are compressed in parallel and written in order
+    auto writer = ArchiveWriter();
+    eq(writer.open(filename), true);
+    writer.set_deduplicate(true);
+    eq(writer.write("uid", as_byte_view(hello), time), true);
+    for (auto i = 0u; i < names.size(); ++i)
+      writer.async_write(names[i], as_byte_view(contents[i]), time, false, succeeded);
+    writer.async_write(deflated_file, as_byte_view(hello), time, false, succeeded);
+    writer.async_write(gzip_file,
+      *get_gzip_deflate_stream(as_byte_view(gzip)), time, succeeded);
+    writer.async_write(stored_file, as_byte_view(hello), time, false, succeeded);
+    writer.async_write(same_crc32_file, as_byte_view(same_crc32), time, false, succeeded);
+    writer.async_write(forged_crc32_file, as_byte_view(forged_crc32), time, false, succeeded);
+    writer.flush();
+    eq(writer.write("headers", as_byte_view(serialized_headers), time), true);
+    eq(writer.close(), true);
+
+    // index is referenced by archive comment
+    auto mapped_file = MappedFile();
+    eq(mapped_file.open(filename), true);
+    const auto file = as_string_view(mapped_file.data());
+    eq(file.find("WRIX ", file.size() - 64) != std::string_view::npos, true);
+    mapped_file.close();
+
+    auto reader = ArchiveReader();
+    eq(reader.open(filename), true);
+    auto previous_offset = uint64_t{ };
+    for (auto i = 0u; i < names.size(); ++i) {
+      const auto info = reader.get_file_info(names[i]);
+      eq(info->data_offset > previous_offset, true);
+      eq(info->compression_method, 8);
+      eq(info->modification_time, time);
+      eq(read(reader, names[i]), contents[i]);
+      eq(reader.read_raw(names[i]).size(), info->compressed_size);
+      previous_offset = info->data_offset;
+    }
+
+    // stored files are read from mapped file
+    auto buffer = ByteVector();
+    eq(as_string_view(reader.read(same_crc32_file, buffer)), same_crc32);
+    eq(buffer.empty(), true);
+
+    // headers are read from archive
+    const auto stored_headers_data = reader.read("headers");
+    auto stored_headers = HeaderStore();
+    stored_headers.deserialize(as_string_view(stored_headers_data));
+    eq(stored_headers.read("http://www.a.com/a.txt")->status_code, StatusCode::success_ok);
+
+    // identical content is stored once, also when it was compressed differently
+    eq(reader.has_aliases(), true);
+    eq(read(reader, gzip_file), hello);
+    eq(read(reader, stored_file), hello);
+    eq(data_offset(reader, gzip_file), data_offset(reader, deflated_file));
+    eq(data_offset(reader, stored_file), data_offset(reader, deflated_file));
+    eq(read(reader, forged_crc32_file), forged_crc32);
+    eq(data_offset(reader, forged_crc32_file) != data_offset(reader, same_crc32_file), true);
+    reader.close();
+
+    // superseded files are replaced instead of appended
+    const auto file_size = std::filesystem::file_size(filename);
+    for (auto i = 0; i < 2; ++i) {
+      auto appender = ArchiveWriter();
+      eq(appender.open(filename, true, { "headers" }), true);
+      eq(appender.write("headers", as_byte_view(serialized_headers), time), true);
+      eq(appender.close(), true);
+      eq(std::filesystem::file_size(filename), file_size);
+    }
+
+    // archive is not modified before appending finished
+    const auto appended_file = std::string("http/www.a.com/appended.txt");
+    auto appender = ArchiveWriter();
+    eq(appender.open(filename, true, { "headers" }), true);
+    eq(appender.write(appended_file, as_byte_view(contents[0]), time), true);
+    eq(appender.write("headers", as_byte_view(serialized_headers), time), true);
+    appender.flush();
+    eq(std::filesystem::file_size(filename), file_size);
+    eq(appender.close(), true);
+
+    eq(reader.open(filename), true);
+    eq(read(reader, appended_file), contents[0]);
+    eq(data_offset(reader, appended_file) < data_offset(reader, "headers"), true);
+    eq(read(reader, names.back()), contents.back());
+    eq(read(reader, gzip_file), hello);
+    eq(reader.has_aliases(), true);
+
+    // compressed data is copied as it is, aliases are kept
+    auto compactor = ArchiveWriter();
+    eq(compactor.open(compacted), true);
+    compactor.set_deduplicate(reader.has_aliases());
+    reader.for_each_file([&](std::string filename) {
+      if (filename == "index" || filename == "aliases")
+        return;
+      const auto info = reader.get_file_info(filename);
+      compactor.async_write_raw(filename, reader.read_raw(filename),
+        info->compression_method, info->crc32, info->uncompressed_size,
+        info->modification_time, succeeded);
+    });
+    compactor.flush();
+    eq(compactor.close(), true);
+    eq(std::filesystem::file_size(compacted) <= std::filesystem::file_size(filename), true);
+
+    auto compacted_reader = ArchiveReader();
+    eq(compacted_reader.open(compacted), true);
+    reader.for_each_file([&](std::string filename) {
+      if (filename != "index" && filename != "aliases")
+        eq(read(compacted_reader, filename), read(reader, filename));
+    });
+    eq(compacted_reader.has_aliases(), true);
+    eq(data_offset(compacted_reader, gzip_file), data_offset(compacted_reader, deflated_file));
+    eq(data_offset(compacted_reader, forged_crc32_file) !=
+       data_offset(compacted_reader, same_crc32_file), true);
+    compacted_reader.close();
+    reader.close();
+  }
+
+  void test_html_patcher() {
+    const auto html = std::string("<html><head><title>Title</title></head>"
+      "<body><script integrity='x' src='a.js'></script></body></html>");
+    const auto patch = [&](std::shared_ptr<const HtmlPatches> patches) {
+      return HtmlPatcher("http://127.0.0.1:8080", "http://www.a.com/", html,
+        "/__webrecorder.js", true, true, "a=b", 0, std::move(patches));
+    };
+    const auto patcher = patch(nullptr);
+    const auto patched = patcher.get_patched();
+    eq(patched.find("integrity"), std::string::npos);
+    eq(patched.find("Title [127.0.0.1]") != std::string::npos, true);
+    eq(patched.find("<base href='http://www.a.com/'>") != std::string::npos, true);
+    eq(patched.find("cookies:'a=b'") != std::string::npos, true);
+
+    auto cache = HtmlPatchCache();
+    cache.set("key", patcher.patches(), "http/www.a.com/index");
+    auto restored = HtmlPatchCache();
+    restored.deserialize(cache.serialize());
+    eq(patch(restored.get("key")).get_patched(), patched);
+    eq(restored.serialize(), cache.serialize());
+
+    // unused entries are only kept while their documents are archived
+    auto unused = HtmlPatchCache();
+    unused.deserialize(cache.serialize());
+    eq(unused.serialize([](const std::string&) { return false; }), "");
+    eq(unused.serialize([](const std::string& filename) {
+      return filename == "http/www.a.com/index"; }), cache.serialize());
+
+    // size of cache is bounded, unused entries are evicted first
+    auto big_patches = std::make_shared<HtmlPatches>();
+    big_patches->patches.push_back({ 0, 0, std::string(1 << 20, 'x') });
+    auto bounded = HtmlPatchCache();
+    for (auto key : { "a", "b", "c", "d" })
+      bounded.set(key, big_patches, "");
+    eq(bounded.get("c") != nullptr, true);
+    eq(bounded.get("d"), nullptr);
+    auto evicting = HtmlPatchCache();
+    evicting.deserialize(bounded.serialize());
+    evicting.set("d", big_patches, "");
+    eq(evicting.get("d") != nullptr, true);
+    eq(evicting.get("a"), nullptr);
+    eq(evicting.get("b") != nullptr, true);
+
+    const auto links = std::string("<html><head><link rel='stylesheet' href='a.css'>"
+      "<link rel='canonical' href='b'></head><body><img src='b.png' "
+      "srcset='c.png 1x, http://www.b.com/d.png 2x'><a href='e'></a></body></html>");
+    const auto urls = HtmlPatcher("http://127.0.0.1:8080", "http://www.a.com/",
+      links, "", false, false, "", 0, nullptr, true).subresource_urls();
+    eq(urls.size(), 4u);
+    eq(std::count(urls.begin(), urls.end(), "http://www.a.com/a.css"), 1);
+    eq(std::count(urls.begin(), urls.end(), "http://www.a.com/b.png"), 1);
+    eq(std::count(urls.begin(), urls.end(), "http://www.a.com/c.png"), 1);
+    eq(std::count(urls.begin(), urls.end(), "http://www.b.com/d.png"), 1);
+
+    // big documents are scanned, which has to find the same patches
+    const auto padding = std::string(1 << 20, ' ');
+    for (const auto& document : { html, links,
+        std::string("<html><head><a =\"x\"><title>Title</title></head></html>"),
+        std::string("<html><head><meta http-equiv=Content-Security-Policy content=x>"
+          "<base href=/sub/><title>Title</title></head><body><script src=a.js "
+          "integrity=x crossorigin></script><img alt=\"<img>\" src=b.png></body></html>") }) {
+      const auto patch_document = [&](const std::string& data) {
+        return HtmlPatcher("http://127.0.0.1:8080", "http://www.a.com/", data,
+          "/__webrecorder.js", true, true, "", 0, nullptr, true);
+      };
+      const auto parser = patch_document(document);
+      const auto padded = document + padding;
+      const auto scanner = patch_document(padded);
+      const auto& parsed = *parser.patches();
+      const auto& scanned = *scanner.patches();
+      eq(scanned.patches.size(), parsed.patches.size());
+      for (auto i = size_t{ }; i < std::min(scanned.patches.size(), parsed.patches.size()); ++i) {
+        eq(scanned.patches[i].offset, parsed.patches[i].offset);
+        eq(scanned.patches[i].size, parsed.patches[i].size);
+        eq(scanned.patches[i].patch, parsed.patches[i].patch);
+      }
+      eq(scanned.script_offset, parsed.script_offset);
+      eq(scanned.base_url, parsed.base_url);
+      auto parsed_urls = parser.subresource_urls();
+      auto scanned_urls = scanner.subresource_urls();
+      std::sort(parsed_urls.begin(), parsed_urls.end());
+      std::sort(scanned_urls.begin(), scanned_urls.end());
+      eq(scanned_urls, parsed_urls);
+    }
+  }
 } // namepace
 
 void tests() {
   test_common();
   test_logic();
+  test_header_store();
+  test_file_index();
+  test_response_cache();
+  test_archive();
+  test_html_patcher();
 }